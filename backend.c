@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "backend.h"
 #include "runtime/data_layout.h"
 #include "runtime/builtins.h"
@@ -11,7 +12,9 @@
 #include <limits.h>
 #include <assert.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 
 /************** General utils *************/
@@ -20,9 +23,37 @@
 
 static void init_code_buf(void);
 
-static uint8_t *code_buf_start = NULL;
-static uint8_t *code_buf = NULL;
-static uint8_t *code_buf_end = NULL;
+static __thread uint8_t *code_buf_start = NULL;
+static __thread uint8_t *code_buf = NULL;
+static __thread uint8_t *code_buf_end = NULL;
+// The buffer is mapped twice, from the same memfd: code_buf and friends point
+// into the executable view, and code gets written through the writable one,
+// this far away
+static __thread ptrdiff_t code_rw_offset = 0;
+// Where code gets written, this far from where it'll run: usually the
+// writable view, but lazily compiled code gets put together elsewhere first
+static __thread ptrdiff_t code_write_offset = 0;
+// The buffer's pages are in memory up to here, in both views
+static __thread uint8_t *code_buf_populated = NULL;
+// Fault the pages in this many bytes at a time, since shared pages are slow
+// to fault in one at a time
+#define POPULATE_BYTES (256 * 1024)
+// compile_reset keeps this much of the buffer in memory
+#define CODE_KEEP_BYTES (4 * POPULATE_BYTES)
+
+// Whether to compile closures other than the top-level one on first entry
+static bool lazy_compile = false;
+// Whether lazily compiled closures get profiled first, and recompiled once
+// they're hot
+static bool tiered_compile = false;
+// Whether thunks with two or more free variables store them as 32-bit
+// pointers. The code buffer and the heap have to be below 2G
+static bool compress_thunks = false;
+
+// For compile_stats
+static __thread size_t moves_bytes = 0;
+static __thread double moves_seconds = 0;
+static __thread bool time_moves = false;
 
 static void write_header(uint32_t size, uint32_t tag);
 static void write_code(size_t len, const uint8_t code[len]);
@@ -51,6 +82,7 @@ enum reg {
 #define ARGC        R15
 
 static void mem64(uint8_t opcode, enum reg reg, enum reg ptr, int32_t offset);
+static void mem32(uint8_t opcode, enum reg reg, enum reg ptr, int32_t offset);
 static void reg64(uint8_t opcode, enum reg reg, enum reg other_reg);
 
 #define OP_LOAD 0x8b
@@ -60,13 +92,19 @@ static void reg64(uint8_t opcode, enum reg reg, enum reg other_reg);
   mem64(OP_LOAD, reg, ptr, offset)
 #define STORE(reg, ptr, offset) \
   mem64(OP_STORE, reg, ptr, offset)
+// 32-bit loads zero the top half of the register
+#define LOAD32(reg, ptr, offset) \
+  mem32(OP_LOAD, reg, ptr, offset)
+#define STORE32(reg, ptr, offset) \
+  mem32(OP_STORE, reg, ptr, offset)
 #define MOV_RR(dest, src) reg64(OP_STORE, src, dest)
 
 // Add constant value 'imm' to register 'reg'
 static void add_imm(enum reg reg, int32_t imm);
 
 // idx 0 is the first env item. env is usually SELF
-static void load_env_item(enum reg reg, enum reg env, size_t idx);
+static void load_env_item(enum reg reg, enum reg env, size_t idx,
+    bool compressed);
 // idx 0 is the top of the stack
 static void load_arg(enum reg reg, size_t idx);
 static void store_arg(size_t idx, enum reg reg);
@@ -74,60 +112,190 @@ static void store_arg(size_t idx, enum reg reg);
 static void blackhole_self(void);
 
 
-struct var_info {
-  bool is_used;
-  // Only when used
-  size_t env_idx;
-};
-
 struct env {
-  // do we need?
-  struct env *up;
   var args_start;
   var lets_start;
   size_t envc;
-  // args_start elements, envc of which are used
-  struct var_info upvals[];
+  // The free variables of the closure, sorted. Env item i holds upvals[i]
+  var *upvals;
+  // For thunks with at least two free variables, with compress_thunks: they
+  // hold 32-bit pointers, two to a word
+  bool compressed;
 };
 
+struct lazy_closure;
+
 struct compile_result {
   void *code;
-  struct env *env;
+  struct env env;
+  // If the code is a stub that compiles it on first entry
+  struct lazy_closure *lazy;
+  // A closed function's one instance, which never needs allocating
+  obj *static_obj;
 };
 
 static size_t var_to_stack_index(size_t lvl, struct env *env, var v);
-static void make_sure_can_access_var(struct env *env, var v);
+static size_t env_index(struct env *env, var v);
+
+
+/************** Scratch space *************/
+
+// All of the compiler's scratch data lives in a few big mmap'd regions, used
+// as stacks. Reserving the address space up front keeps pointers stable, and
+// the kernel only commits the pages that actually get touched.
+struct region {
+  uint8_t *start;
+  uint8_t *top;
+  uint8_t *end;
+};
+
+#define SCRATCH_BYTES ((size_t) 1 << 32)
+
+// Free variable sets and parallel move state
+static __thread struct region scratch;
+// The compile worklist
+static __thread struct region worklist;
+// What lazily compiled closures need to compile them, until compile_reset.
+// The scratch space stays around too, when there are any
+static __thread struct region lazy_area;
+// Where they get compiled, before getting copied into the code buffer
+static __thread struct region staging;
+
+static void region_init(struct region *r, size_t len) {
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    failwith("Couldn't reserve compiler scratch space: %s\n", strerror(errno));
+  r->start = r->top = p;
+  r->end = r->start + len;
+}
+
+static void region_free(struct region *r) {
+  munmap(r->start, r->end - r->start);
+  r->start = r->top = r->end = NULL;
+}
+
+static void *region_alloc(struct region *r, size_t bytes) {
+  bytes = (bytes + 7) & ~7;
+  if (bytes > (size_t) (r->end - r->top))
+    failwith("Term too big\n");
+  void *p = r->top;
+  r->top += bytes;
+  return p;
+}
+
+#define REGION_ALLOC(r, ty, n) ((ty *) region_alloc(r, sizeof(ty) * (n)))
 
 
 static void init_code_buf(void) {
   if (code_buf)
     return;
 
-  // Need to mmap it so that I can mprotect it later.
-  const size_t len = 8 * 1024 * 1024;
-  code_buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (!code_buf)
-    failwith("Couldn't allocate buffer for code\n");
-  code_buf_start = code_buf;
+  // Map it twice, so that code can get compiled while other code runs,
+  // without any page ever being both writable and executable. Only the pages
+  // that get written to use memory
+  const size_t len = 64 * 1024 * 1024;
+  int fd = memfd_create("lc-code", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, len))
+    failwith("Couldn't allocate buffer for code: %s\n", strerror(errno));
+  uint8_t *rw = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  // Compressed thunks can point to static objects, so those have to be
+  // below 2G too
+  uint8_t *rx = mmap(NULL, len, PROT_READ | PROT_EXEC,
+      MAP_SHARED | (compress_thunks ? MAP_32BIT : 0), fd, 0);
+  close(fd);
+  if (rw == MAP_FAILED || rx == MAP_FAILED)
+    failwith("Couldn't map buffer for code: %s\n", strerror(errno));
+  code_buf = code_buf_start = code_buf_populated = rx;
   code_buf_end = code_buf_start + len;
+  code_rw_offset = code_write_offset = rw - rx;
 }
 
 void compile_finalize(void) {
-  // mprotect it
-  size_t len = code_buf_end - code_buf_start;
-  if (mprotect(code_buf_start, len, PROT_READ | PROT_EXEC))
-    failwith("Couldn't map as executable: %s\n", strerror(errno));
+  rt_register_code(code_buf_start, code_buf_end);
 }
 
-static void write_code(size_t len, const uint8_t code[len]) {
+void compile_reset(void) {
+  if (!code_buf)
+    return;
+  code_buf = code_buf_start;
+  // Give back the pages past what most terms need. They're shared memory, so
+  // that takes MADV_REMOVE, and it goes for both views
+  uint8_t *keep = code_buf_start + CODE_KEEP_BYTES;
+  if (code_buf_populated > keep) {
+    madvise(keep + code_rw_offset, code_buf_populated - keep, MADV_REMOVE);
+    code_buf_populated = keep;
+  }
+  if (lazy_area.start) {
+    region_free(&lazy_area);
+    region_free(&staging);
+    region_free(&scratch);
+  }
+  moves_bytes = 0;
+  moves_seconds = 0;
+}
+
+void compile_stats(struct compile_stats *stats) {
+  *stats = (struct compile_stats) {
+    .code_bytes = code_buf - code_buf_start,
+    .moves_bytes = moves_bytes,
+    .moves_seconds = moves_seconds,
+  };
+}
+
+void compile_time_moves(bool on) {
+  time_moves = on;
+}
+
+void compile_lazily(bool on) {
+  lazy_compile = on;
+}
+
+void compile_tiered(bool on) {
+  tiered_compile = on;
+}
+
+void compile_compressed(bool on) {
+  compress_thunks = on;
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Where to write to change the code at p
+static uint8_t *writable(void *p) {
+  return (uint8_t *) p + code_write_offset;
+}
+
+// Make room for len more bytes of code
+static void reserve_code(size_t len) {
   uint8_t *end = code_buf + len;
   if (end > code_buf_end) failwith("Too much code");
-  memcpy(code_buf, code, len);
+  while (end > code_buf_populated) {
+    size_t bytes = code_buf_end - code_buf_populated;
+    if (bytes > POPULATE_BYTES)
+      bytes = POPULATE_BYTES;
+    // Older kernels can't, and then the pages just get faulted in as usual
+    madvise(code_buf_populated + code_rw_offset, bytes, MADV_POPULATE_WRITE);
+    madvise(code_buf_populated, bytes, MADV_POPULATE_READ);
+    code_buf_populated += bytes;
+  }
+}
+
+static void write_code(size_t len, const uint8_t code[len]) {
+  reserve_code(len);
+  uint8_t *end = code_buf + len;
+  memcpy(writable(code_buf), code, len);
   code_buf = end;
 }
 
 #define REXW(R,X,B) \
   (0x48 | ((R >> 1) & 4) | ((X >> 2) & 3) | (B >> 3))
+#define REX(R,X,B) \
+  (0x40 | ((R >> 1) & 4) | ((X >> 2) & 3) | (B >> 3))
 #define MODRM(Mod, Reg, RM) \
   (((Mod) << 6) | ((Reg & 7) << 3) | (RM & 7))
 
@@ -140,9 +308,8 @@ static void reg64(uint8_t opcode, enum reg reg, enum reg other_reg) {
   );
 }
 
-static void mem64(uint8_t opcode, enum reg reg, enum reg ptr, int32_t offset) {
-  CODE(REXW(reg, 0, ptr), opcode);
-
+// The ModRM byte and what follows it, for [ptr + offset]
+static void modrm_mem(enum reg reg, enum reg ptr, int32_t offset) {
   if ((ptr & 7) == RSP) {
     // r/m == rsp: [SIB]
 
@@ -154,7 +321,7 @@ static void mem64(uint8_t opcode, enum reg reg, enum reg ptr, int32_t offset) {
       CODE(MODRM(1, reg, RSP), 0x24, (uint8_t) offset);
     else
       // Mod == 10 && index == rsp: [base + disp32]
-      CODE(MODRM(2, reg, RSP), 0x24, (uint32_t) offset);
+      CODE(MODRM(2, reg, RSP), 0x24, U32((uint32_t) offset));
 
     return;
   }
@@ -170,6 +337,18 @@ static void mem64(uint8_t opcode, enum reg reg, enum reg ptr, int32_t offset) {
     CODE(MODRM(2, reg, ptr), U32((uint32_t) offset));
 }
 
+static void mem64(uint8_t opcode, enum reg reg, enum reg ptr, int32_t offset) {
+  CODE(REXW(reg, 0, ptr), opcode);
+  modrm_mem(reg, ptr, offset);
+}
+
+static void mem32(uint8_t opcode, enum reg reg, enum reg ptr, int32_t offset) {
+  if (reg >= R8 || ptr >= R8)
+    CODE(REX(reg, 0, ptr));
+  CODE(opcode);
+  modrm_mem(reg, ptr, offset);
+}
+
 static void add_imm(enum reg reg, int32_t imm) {
   if (imm == 0) return;
   if (-128 <= imm && imm < 128)
@@ -185,17 +364,27 @@ static size_t var_to_stack_index(size_t lvl, struct env *env, var v) {
   else
     return v - env->args_start + lvl - env->lets_start;
 }
-static void make_sure_can_access_var(struct env *env, var v) {
-  while (v < env->args_start && !env->upvals[v].is_used) {
-    env->upvals[v].is_used = true;
-    env->upvals[v].env_idx = env->envc++;
-    env = env->up;
+static size_t env_index(struct env *env, var v) {
+  // Binary search the sorted upvals
+  size_t lo = 0, hi = env->envc;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (env->upvals[mid] < v)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  assert(lo < env->envc && env->upvals[lo] == v);
+  return lo;
 }
 
-static void load_env_item(enum reg reg, enum reg env, size_t idx) {
+static void load_env_item(enum reg reg, enum reg env, size_t idx,
+    bool compressed) {
   assert(idx < INT_MAX / 8 - 8);
-  LOAD(reg, env, 8 * idx + 8);
+  if (compressed)
+    LOAD32(reg, env, 4 * idx + 8);
+  else
+    LOAD(reg, env, 8 * idx + 8);
 }
 static void load_arg(enum reg reg, size_t idx) {
   assert(idx < INT_MAX / 8);
@@ -220,32 +409,51 @@ static void blackhole_self(void) {
 /******************* Prologue *****************/
 
 static void *start_closure(size_t argc, size_t envc);
-static void *start_thunk(size_t envc);
+static void *start_thunk(struct env *env);
+
+// The size of a closure's objects in words
+static size_t closure_words(struct env *env) {
+  if (env->envc == 0)
+    // The entrypoint and an info word
+    return 2;
+  if (env->compressed)
+    return 1 + (env->envc + 1) / 2;
+  return env->envc + 1;
+}
+
+// What goes in a closure's header. Without free variables, the info word has
+// the size
+static uint32_t header_size(struct env *env) {
+  return env->envc == 0 ? 0 : closure_words(env);
+}
 
 
 static void write_header(uint32_t size, uint32_t tag) {
   // Align up to nearest word
   code_buf = (uint8_t *) (((size_t) code_buf + 7) & ~7);
 
-  if (code_buf + 8 > code_buf_end) failwith("Too much code");
+  reserve_code(8);
 
-  memcpy(code_buf, &size, sizeof(uint32_t));
+  memcpy(writable(code_buf), &size, sizeof(uint32_t));
   code_buf += sizeof(uint32_t);
-  memcpy(code_buf, &tag, sizeof(uint32_t));
+  memcpy(writable(code_buf), &tag, sizeof(uint32_t));
   code_buf += sizeof(uint32_t);
 }
 
 static void *start_closure(size_t argc, size_t envc) {
-  /* assert(argc < INT_MAX); */
-  assert(argc < 127); // TODO: allow more args (? maybe)
+  assert(argc < INT_MAX);
   assert(envc < INT_MAX);
 
   write_header(envc == 0 ? 0 : envc + 1, FUN);
   void *code_start = code_buf;
 
+  if (argc < 128)
+    // cmp r15, imm8
+    CODE(0x49, 0x83, 0xff, (uint8_t) argc);
+  else
+    // cmp r15, imm32
+    CODE(0x49, 0x81, 0xff, U32((uint32_t) argc));
   CODE(
-    // cmp r15, argc
-    0x49, 0x83, 0xff, (uint8_t) argc,
     // jge rest_of_code (+12)
     0x7d, 12,
     // movabs rt_too_few_args, %rdi
@@ -258,10 +466,10 @@ static void *start_closure(size_t argc, size_t envc) {
   return code_start;
 }
 
-static void *start_thunk(size_t envc) {
-  assert(envc < INT_MAX);
+static void *start_thunk(struct env *env) {
+  assert(env->envc < INT_MAX);
 
-  write_header(envc == 0 ? 0 : envc + 1, THUNK);
+  write_header(header_size(env), THUNK | (env->compressed ? COMPRESSED : 0));
   void *code_start = code_buf;
 
   CODE(
@@ -302,7 +510,67 @@ static void *start_thunk(size_t envc) {
 
 /***************** Allocations ****************/
 
-static void do_allocations(struct env *this_env, size_t n, struct compile_result locals[n]);
+/** An entry in the compile worklist.
+ *
+ * The worklist is a stack that holds the terms currently being compiled, each
+ * followed by the results of its already-compiled lets. Once a term's lets are
+ * done, it's compiled and its entry is overwritten with its own result.
+ */
+struct work_item {
+  ir term;
+  // The next let to compile
+  letlist next_let;
+  // The index of the enclosing term in the worklist
+  size_t parent;
+  struct compile_result result;
+};
+
+/** A closure that gets compiled on first entry.
+ *
+ * Its entrypoint is a stub that jumps to c->entry, which starts out as
+ * compile_on_entry_stub. That compiles it, along with the first few closures
+ * it allocates, and points c->entry at the code. It also patches the
+ * allocation in its parent, so that later closures skip the stub. The stub
+ * itself stays the same, since writing to code that just ran is slow.
+ *
+ * With tiered compilation, that first version counts its entries and
+ * records the head of its tail call. After HOT_ENTRIES entries it gets
+ * compiled again, using what it saw. c->entry and the parent then get the
+ * new code, and the old code's entry jumps to it.
+ */
+struct lazy_closure {
+  void *entry;
+  ir term;
+  struct env env;
+  // The results of its lets, which are all stubs
+  struct work_item *locals;
+  void *stub;
+  // Where the parent's code loads the stub's address, once it's compiled
+  uint8_t *site;
+
+  // Entries left until it's hot
+  uint64_t countdown;
+  // The entrypoint it tail calls: null until it's entered, and 1 once it's
+  // seen more than one
+  void *callee;
+  // Where the profiled code's body continues, in the optimized code
+  void *optimized_body;
+};
+
+enum tier {
+  // Compiled just once
+  TIER_ONLY,
+  TIER_PROFILED,
+  TIER_OPTIMIZED,
+};
+
+#define HOT_ENTRIES 100
+
+
+static void do_allocations(struct env *this_env, size_t n, struct work_item locals[n]);
+
+// What stubs jump to until their closure is compiled
+void compile_on_entry_stub(void);
 
 
 static void heap_check(size_t bytes_allocated) {
@@ -335,50 +603,67 @@ static void load_var(size_t lvl, struct env *this_env, enum reg dest, var v) {
     size_t idx = var_to_stack_index(lvl, this_env, v);
     load_arg(dest, idx);
   } else {
-    assert(this_env->upvals[v].is_used);
-    load_env_item(dest, SELF, this_env->upvals[v].env_idx);
+    load_env_item(dest, SELF, env_index(this_env, v), this_env->compressed);
   }
 }
 
-static void do_allocations(struct env *this_env, size_t n, struct compile_result locals[n]) {
+static void do_allocations(struct env *this_env, size_t n, struct work_item locals[n]) {
   size_t lvl = this_env->lets_start;
   if (n == 0)
     return;
 
   size_t words_allocated = 0;
   for (size_t i = 0; i < n; i++) {
-    if (locals[i].env->envc == 0)
-      words_allocated += 2;
-    else
-      words_allocated += locals[i].env->envc + 1;
+    if (locals[i].result.static_obj)
+      continue;
+    words_allocated += closure_words(&locals[i].result.env);
   }
 
-  heap_check(8 * words_allocated);
-
-  MOV_RR(RDI, HEAP_PTR);
+  if (words_allocated) {
+    heap_check(8 * words_allocated);
+    MOV_RR(RDI, HEAP_PTR);
+  }
   for (size_t i = 0; i < n; i++) {
     lvl++;
     add_imm(DATA_STACK, -8);
+    if (locals[i].result.static_obj) {
+      // movabs rsi, static_obj
+      CODE(0x48, 0xbe, U64((uint64_t) locals[i].result.static_obj));
+      STORE(RSI, DATA_STACK, 0);
+      continue;
+    }
     STORE(RDI, DATA_STACK, 0);
 
     // Store the entrypoint
+    void *entry = locals[i].result.code;
+    struct lazy_closure *lazy = locals[i].result.lazy;
+    if (lazy) {
+      if (lazy->entry != compile_on_entry_stub)
+        entry = lazy->entry;
+      // If it gets (re)compiled, this gets the new code
+      lazy->site = code_buf + 2;
+    }
     // movabs rsi, entrypoint
-    CODE(0x48, 0xbe, U64((uint64_t) locals[i].code));
+    CODE(0x48, 0xbe, U64((uint64_t) entry));
     STORE(RSI, RDI, 0);
 
     // Store the contents
-    struct env *env = locals[i].env;
-    assert(env->up == this_env);
-    size_t count = 0;
-    for (var v = 0; v < env->args_start; v++) {
-      if (!env->upvals[v].is_used)
-        continue;
-      count++;
-      load_var(lvl, this_env, RSI, v);
-      size_t offset = 8 + 8*env->upvals[v].env_idx;
-      STORE(RSI, RDI, offset);
+    struct env *env = &locals[i].result.env;
+    assert(env->args_start == this_env->lets_start);
+    if (env->compressed) {
+      // With an odd number, the last one goes in both halves of its word
+      for (size_t j = 0; j < 2 * (closure_words(env) - 1); j++) {
+        size_t k = j < env->envc ? j : env->envc - 1;
+        if (k == j)
+          load_var(lvl, this_env, RSI, env->upvals[k]);
+        STORE32(RSI, RDI, 8 + 4*j);
+      }
+    } else {
+      for (size_t j = 0; j < env->envc; j++) {
+        load_var(lvl, this_env, RSI, env->upvals[j]);
+        STORE(RSI, RDI, 8 + 8*j);
+      }
     }
-    assert(count == env->envc);
 
     if (env->envc == 0) {
       // Store the info_word
@@ -387,8 +672,10 @@ static void do_allocations(struct env *this_env, size_t n, struct compile_result
     }
 
     // Bump rdi, used as a temporary heap pointer
-    if (i != n-1)
-      add_imm(RDI, env->envc == 0 ? 16 : 8 + 8*env->envc);
+    size_t words = closure_words(env);
+    words_allocated -= words;
+    if (words_allocated)
+      add_imm(RDI, 8 * words);
   }
 }
 
@@ -413,6 +700,8 @@ typedef struct {
   int *src_to_dest; // n + 1 of them
   int in_rdi;
   bool for_a_thunk;
+  // Whether the env has 32-bit pointers
+  bool compressed;
 } mov_state;
 
 // Store src to all its destinations, so that it can be overwritten afterwards.
@@ -443,24 +732,32 @@ static void vacate_one(mov_state *s, int src) {
 
     s->dest_info[src].status = IN_PROGRESS;
     if (src == s->n) {
-      // Clear out 'self' by storing all the things from the env
+      // Clear out 'self' by storing all the things from the env. Overwriting
+      // self itself goes last, since blackholing clobbers the first env item
+      int self_dest = -1;
       FOREACH_DEST(dest) {
         assert(s->dest_info[dest].src_type == FROM_ENV);
+        if (dest == s->n) {
+          self_dest = dest;
+          continue;
+        }
 
         vacate_one(s, dest);
 
         enum reg self = s->in_rdi == s->n ? RDI : SELF;
-        if (dest == s->n) {
-          if (s->for_a_thunk) {
-            load_env_item(RSI, self, s->dest_info[dest].src_idx);
-            blackhole_self();
-            MOV_RR(SELF, RSI);
-          } else {
-            load_env_item(SELF, self, s->dest_info[dest].src_idx);
-          }
+        load_env_item(RSI, self, s->dest_info[dest].src_idx, s->compressed);
+        store_arg(dest, RSI);
+      }
+      if (self_dest != -1) {
+        assert(s->in_rdi != s->n);
+        if (s->for_a_thunk) {
+          load_env_item(RSI, SELF, s->dest_info[self_dest].src_idx,
+              s->compressed);
+          blackhole_self();
+          MOV_RR(SELF, RSI);
         } else {
-          load_env_item(RSI, self, s->dest_info[dest].src_idx);
-          store_arg(dest, RSI);
+          load_env_item(SELF, SELF, s->dest_info[self_dest].src_idx,
+              s->compressed);
         }
       }
     } else {
@@ -510,10 +807,9 @@ static void add_dest_to_mov_state(size_t lvl, struct env *env, mov_state *s, int
       s->src_to_dest[src] = dest;
   } else {
     // It's from the env
-    assert(env->upvals[v].is_used);
     s->dest_info[dest] = (struct dest_info_item) {
       .src_type = FROM_ENV,
-      .src_idx = env->upvals[v].env_idx,
+      .src_idx = env_index(env, v),
       .next_with_same_src = s->src_to_dest[s->n],
       .status = NOT_STARTED
     };
@@ -543,12 +839,14 @@ static void do_the_moves(size_t lvl, ir term, struct env *env) {
   }
 
   // Generate the data structures and stuff
+  uint8_t *scratch_mark = scratch.top;
   mov_state s = (mov_state) {
     .n = n,
-    .dest_info = malloc(sizeof(struct dest_info_item[n+1])),
-    .src_to_dest = malloc(sizeof(int[n+1])),
+    .dest_info = REGION_ALLOC(&scratch, struct dest_info_item, n + 1),
+    .src_to_dest = REGION_ALLOC(&scratch, int, n + 1),
     .in_rdi = -1,
     .for_a_thunk = term->arity == 0,
+    .compressed = env->compressed,
   };
 
   for (int i = 0; i < n + 1; i++)
@@ -569,6 +867,7 @@ static void do_the_moves(size_t lvl, ir term, struct env *env) {
     vacate_one(&s, i);
     assert(s.in_rdi == -1);
   }
+  scratch.top = scratch_mark;
 
   // Resize the data stack and set argc
   if (outgoing_argc < incoming_argc) {
@@ -587,72 +886,461 @@ static void call_self(void) {
   CODE(0xff, 0x23);
 }
 
+// Record the entrypoint in c->callee on the way
+static void call_self_profiled(struct lazy_closure *c) {
+  CODE(
+    // mov rax, [self]
+    0x48, 0x8b, 0x03,
+    // movabs rdi, &c->callee
+    0x48, 0xbf, U64((uint64_t) &c->callee),
+    // mov rsi, [rdi]
+    0x48, 0x8b, 0x37,
+    // cmp rsi, rax
+    0x48, 0x39, 0xc6,
+    // je call (+21)
+    0x74, 21,
+    // cmp rsi, 1
+    0x48, 0x83, 0xfe, 0x01,
+    // je call (+15)
+    0x74, 15,
+    // The first one it sees goes in, and after that it's 1
+    // test rsi, rsi
+    0x48, 0x85, 0xf6,
+    // mov esi, 1
+    0xbe, U32(1),
+    // cmovz rsi, rax
+    0x48, 0x0f, 0x44, 0xf0,
+    // mov [rdi], rsi
+    0x48, 0x89, 0x37,
+    // call:
+    // jmp rax
+    0xff, 0xe0
+  );
+}
+
+void compile_on_entry_stub(void);
+
+// Where to jump to enter this code with at least argc arguments, skipping
+// the check for too few, or null if it's not a function compiled here
+static uint8_t *saturated_entry(uint8_t *code, size_t argc) {
+  for (;;) {
+    if (code < code_buf_start + 8 || code + 8 > code_buf_end)
+      return NULL;
+    if (code[0] == 0xe9) {
+      // Profiled code that's been optimized since: jmp rel32
+      int32_t rel;
+      memcpy(&rel, code + 1, sizeof(rel));
+      code += 5 + rel;
+    } else if (code[0] == 0x48 && code[1] == 0xbf) {
+      // A stub: movabs rdi, c
+      struct lazy_closure *c;
+      memcpy(&c, code + 2, sizeof(c));
+      if (c->entry == compile_on_entry_stub)
+        return NULL;
+      code = c->entry;
+    } else {
+      break;
+    }
+  }
+
+  uint32_t tag;
+  memcpy(&tag, code - 4, sizeof(tag));
+  if (tag != FUN)
+    return NULL;
+  // See start_closure
+  uint32_t arity;
+  size_t check_len;
+  if (code[0] == 0x49 && code[1] == 0x83 && code[2] == 0xff) {
+    arity = code[3];
+    check_len = 4 + 14;
+  } else if (code[0] == 0x49 && code[1] == 0x81 && code[2] == 0xff) {
+    memcpy(&arity, code + 3, sizeof(arity));
+    check_len = 7 + 14;
+  } else {
+    return NULL;
+  }
+  return arity <= argc ? code + check_len : NULL;
+}
+
+// If it's always called the same function, check for that and jump straight
+// past its argc check. argc is always at least the number of outgoing args
+static void call_self_optimized(ir term, struct lazy_closure *c) {
+  size_t argc = 0;
+  for (arglist arg = term->args; arg; arg = arg->prev)
+    argc++;
+  uint8_t *target = NULL;
+  if (c->callee && c->callee != (void *) 1)
+    target = saturated_entry(c->callee, argc);
+
+  if (target) {
+    CODE(
+      // movabs rax, callee
+      0x48, 0xb8, U64((uint64_t) c->callee),
+      // cmp [self], rax
+      0x48, 0x39, 0x03,
+      // jne generic (+5)
+      0x75, 5
+    );
+    // jmp target
+    int32_t rel = target - (code_buf + 5);
+    CODE(0xe9, U32((uint32_t) rel));
+    // generic:
+  }
+  call_self();
+}
+
 
 /***************** Tying it all together ****************/
 
 void *compile_toplevel(ir term);
 
 
-static struct compile_result compile(struct env *up, ir term) {
-  size_t lvl = term->lvl;
+static int compare_vars(const void *a, const void *b) {
+  var x = *(const var *) a, y = *(const var *) b;
+  return (x > y) - (x < y);
+}
 
-  // Allocate an environment
-  struct env *env = malloc(sizeof(struct env) + sizeof(struct var_info[lvl]));
-  env->up = up;
-  env->args_start = lvl;
-  env->lets_start = lvl + term->arity;
-  env->envc = 0;
-  for (int i = 0; i < lvl; i++)
-    env->upvals[i].is_used = false;
-
-  // Populate the env
-  make_sure_can_access_var(env, term->head);
+/** Compute the free variables of a term from those of its lets.
+ *
+ * The lets' upvals are contiguous at the top of the scratch space, so once
+ * they're no longer needed, the result can slide down to replace them.
+ */
+static struct env free_vars(ir term, size_t n, struct work_item locals[n]) {
+  struct env env = {
+    .args_start = term->lvl,
+    .lets_start = term->lvl + term->arity,
+    .envc = 0,
+  };
+
+  size_t max = 1;
   for (arglist arg = term->args; arg; arg = arg->prev)
-    make_sure_can_access_var(env, arg->arg);
+    max++;
+  for (size_t i = 0; i < n; i++)
+    max += locals[i].result.env.envc;
+
+  env.upvals = REGION_ALLOC(&scratch, var, max);
+#define ADD_VAR(v) if ((v) < term->lvl) env.upvals[env.envc++] = (v)
+  ADD_VAR(term->head);
+  for (arglist arg = term->args; arg; arg = arg->prev)
+    ADD_VAR(arg->arg);
+  for (size_t i = 0; i < n; i++) {
+    // Sorted, so the ones that are free here are a prefix
+    struct env *let_env = &locals[i].result.env;
+    for (size_t j = 0; j < let_env->envc; j++) {
+      if (let_env->upvals[j] >= term->lvl)
+        break;
+      env.upvals[env.envc++] = let_env->upvals[j];
+    }
+  }
+#undef ADD_VAR
+
+  // Sort and deduplicate
+  qsort(env.upvals, env.envc, sizeof(var), compare_vars);
+  size_t len = 0;
+  for (size_t i = 0; i < env.envc; i++) {
+    if (len == 0 || env.upvals[len - 1] != env.upvals[i])
+      env.upvals[len++] = env.upvals[i];
+  }
+  env.envc = len;
+  return env;
+}
+
+void recompile_stub(void);
 
-  // Compile all the lets
-  struct compile_result *locals =
-    malloc(sizeof(struct compile_result[term->lets_len]));
-  int i = 0;
-  for (letlist let = term->lets; let; let = let->next, i++)
-    locals[i] = compile(env, let->val);
-  assert(i == term->lets_len);
+// Compile the term, given its free variables and its lets' results. Lazily
+// compiled closures pass their lazy_closure, for the tiers
+static void *compile_body(ir term, struct env *env, struct work_item locals[],
+    enum tier tier, struct lazy_closure *c) {
+  size_t n = term->lets_len;
+  size_t lvl = term->lvl;
 
   // Prologue
   void *code_start;
   if (term->arity == 0)
-    code_start = start_thunk(env->envc);
+    code_start = start_thunk(env);
   else
     code_start = start_closure(term->arity, env->envc);
 
+  uint8_t *hot_jump = NULL;
+  if (tier == TIER_PROFILED) {
+    // Count down the entries, past the prologue so that the optimized code
+    // can pick up from here
+    CODE(
+      // movabs rax, &c->countdown
+      0x48, 0xb8, U64((uint64_t) &c->countdown),
+      // dec qword [rax]
+      0x48, 0xff, 0x08,
+      // jz hot
+      0x0f, 0x84, U32(0)
+    );
+    hot_jump = code_buf;
+  } else if (tier == TIER_OPTIMIZED) {
+    c->optimized_body = code_buf;
+  }
+
   lvl += term->arity;
 
   // Allocations
-  do_allocations(env, term->lets_len, locals);
-  for (int i = 0; i < term->lets_len; i++)
-    free(locals[i].env);
-  free(locals);
+  do_allocations(env, n, locals);
 
-  lvl += term->lets_len;
+  lvl += n;
 
   // Set up for call
+  uint8_t *moves_start = code_buf;
+  double start = time_moves ? now() : 0;
   do_the_moves(lvl, term, env);
+  if (time_moves)
+    moves_seconds += now() - start;
+  moves_bytes += code_buf - moves_start;
 
   // Execute the call!
-  call_self();
+  if (tier == TIER_PROFILED)
+    call_self_profiled(c);
+  else if (tier == TIER_OPTIMIZED)
+    call_self_optimized(term, c);
+  else
+    call_self();
+
+  if (hot_jump) {
+    // hot:
+    int32_t rel = code_buf - hot_jump;
+    memcpy(writable(hot_jump - 4), &rel, sizeof(rel));
+    CODE(
+      // movabs rdi, c
+      0x48, 0xbf, U64((uint64_t) c),
+      // movabs rax, recompile_stub
+      0x48, 0xb8, U64((uint64_t) recompile_stub),
+      // jmp rax
+      0xff, 0xe0
+    );
+  }
+  return code_start;
+}
+
+// How many closures to compile at once
+#define COMPILE_AHEAD 16
+
+// These get called from generated code with c in rdi, with the stack
+// aligned, and jump to the code they return
+static void *compile_on_entry(struct lazy_closure *c) __attribute__((used));
+static void *recompile(struct lazy_closure *c) __attribute__((used));
+
+// The closure's registers are all callee-saved, so only the stack needs
+// fixing up
+#define TRAMPOLINE(name, fn) \
+  asm ( \
+    "  .text\n" \
+    name ":\n" \
+    "  push %rbp\n" \
+    "  mov %rsp, %rbp\n" \
+    "  and $-16, %rsp\n" \
+    "  call " fn "\n" \
+    "  mov %rbp, %rsp\n" \
+    "  pop %rbp\n" \
+    "  jmp *%rax\n" \
+  )
+TRAMPOLINE("compile_on_entry_stub", "compile_on_entry");
+TRAMPOLINE("recompile_stub", "recompile");
+
+// Lazily compiled code gets put together somewhere else first, and then
+// copied in: lots of little writes next to code that just ran, even through
+// the other view, make the CPU keep flushing its pipeline
+static uint8_t *start_staging(void) {
+  code_write_offset = staging.start - code_buf;
+  return code_buf;
+}
 
-  return (struct compile_result) {
+static void finish_staging(uint8_t *start) {
+  code_write_offset = code_rw_offset;
+  memcpy(writable(start), staging.start, code_buf - start);
+}
+
+static void *compile_on_entry(struct lazy_closure *c) {
+  // Compile the first few closures it allocates too, breadth first, so that
+  // fewer of them take the slow way through here. None of them can be
+  // compiled yet, since c isn't
+  struct lazy_closure *todo[COMPILE_AHEAD];
+  size_t len = 0;
+  todo[len++] = c;
+  for (size_t i = 0; i < len; i++) {
+    for (size_t j = 0; j < todo[i]->term->lets_len && len < COMPILE_AHEAD; j++)
+      todo[len++] = todo[i]->locals[j].result.lazy;
+  }
+
+  uint8_t *start = start_staging();
+  // Children first, so their parents can allocate them without the stubs
+  enum tier tier = tiered_compile ? TIER_PROFILED : TIER_ONLY;
+  for (size_t i = len; i-- > 0;) {
+    struct lazy_closure *d = todo[i];
+    assert(d->entry == compile_on_entry_stub);
+    d->countdown = HOT_ENTRIES;
+    d->entry = compile_body(d->term, &d->env, d->locals, tier, d);
+  }
+  finish_staging(start);
+
+  // Static objects get patched too, since no parent allocates them
+  for (size_t i = 0; i < len; i++) {
+    struct lazy_closure *d = todo[i];
+    if (d->site)
+      memcpy(writable(d->site), &d->entry, sizeof(d->entry));
+  }
+  return c->entry;
+}
+
+// Called from the profiled code's body once it's hot
+static void *recompile(struct lazy_closure *c) {
+  uint8_t *profiled = c->entry;
+  uint8_t *start = start_staging();
+  void *code = compile_body(c->term, &c->env, c->locals, TIER_OPTIMIZED, c);
+  finish_staging(start);
+
+  c->entry = code;
+  if (c->site)
+    memcpy(writable(c->site), &code, sizeof(code));
+  // jmp code, over the profiled code's prologue. That's all that changes, so
+  // it's fine that there are return addresses further in
+  int32_t rel = (uint8_t *) code - (profiled + 5);
+  uint8_t jmp[] = { 0xe9, U32((uint32_t) rel) };
+  memcpy(writable(profiled), jmp, sizeof(jmp));
+  return c->optimized_body;
+}
+
+// Save what it takes to compile the term later, and write its stub
+static struct lazy_closure *write_stub(ir term, struct env *env,
+    struct work_item locals[]) {
+  size_t n = term->lets_len;
+  struct lazy_closure *c = REGION_ALLOC(&lazy_area, struct lazy_closure, 1);
+  c->term = term;
+  c->env = *env;
+  c->env.upvals = REGION_ALLOC(&lazy_area, var, env->envc);
+  memcpy(c->env.upvals, env->upvals, sizeof(var[env->envc]));
+  c->locals = REGION_ALLOC(&lazy_area, struct work_item, n);
+  for (size_t i = 0; i < n; i++) {
+    // The lets' upvals are in the scratch space, so use their own copies
+    c->locals[i].result = locals[i].result;
+    c->locals[i].result.env.upvals = locals[i].result.lazy->env.upvals;
+  }
+  c->site = NULL;
+  c->callee = NULL;
+  c->optimized_body = NULL;
+  c->entry = compile_on_entry_stub;
+
+  write_header(header_size(env), term->arity == 0
+      ? THUNK | (env->compressed ? COMPRESSED : 0) : FUN);
+  c->stub = code_buf;
+  CODE(
+    // movabs rdi, c
+    0x48, 0xbf, U64((uint64_t) c),
+    // jmp [rdi] (c->entry)
+    0xff, 0x27
+  );
+  return c;
+}
+
+// Closed functions don't need more than one instance, so they get a static
+// one, next to their code. The GC leaves it alone, and never copies it
+static obj *write_static_obj(void *entry) {
+  code_buf = (uint8_t *) (((size_t) code_buf + 7) & ~7);
+  obj *o = (obj *) code_buf;
+  struct info_word info = { .size = 2, .var = 0 };
+  CODE(U64((uint64_t) entry));
+  write_code(sizeof(info), (const uint8_t *) &info);
+  return o;
+}
+
+static void compile_one(struct work_item *item, bool toplevel) {
+  ir term = item->term;
+  size_t n = term->lets_len;
+  struct work_item *locals = &item[1];
+
+  uint8_t *scratch_mark = n ? (uint8_t *) locals[0].result.env.upvals : scratch.top;
+  struct env env = free_vars(term, n, locals);
+  env.compressed = compress_thunks && term->arity == 0 && env.envc >= 2;
+
+  // The top-level term gets entered right away anyway
+  struct lazy_closure *lazy = NULL;
+  void *code_start;
+  if (lazy_compile && !toplevel) {
+    lazy = write_stub(term, &env, locals);
+    code_start = lazy->stub;
+  } else {
+    code_start = compile_body(term, &env, locals, TIER_ONLY, NULL);
+  }
+
+  obj *static_obj = NULL;
+  if (!toplevel && env.envc == 0 && term->arity > 0) {
+    static_obj = write_static_obj(code_start);
+    // Compiling it patches the static object instead of a parent
+    if (lazy)
+      lazy->site = (uint8_t *) &static_obj->entrypoint;
+  }
+
+  // Free the lets' upvals, keeping this one's
+  memmove(scratch_mark, env.upvals, sizeof(var[env.envc]));
+  env.upvals = (var *) scratch_mark;
+  scratch.top = scratch_mark;
+  REGION_ALLOC(&scratch, var, env.envc);
+
+  item->result = (struct compile_result) {
     .code = code_start,
     .env = env,
+    .lazy = lazy,
+    .static_obj = static_obj,
+  };
+}
+
+// Compile the term in post-order, with an explicit stack
+static struct compile_result compile(ir term) {
+  struct work_item *items = (struct work_item *) worklist.start;
+  size_t cur = 0;
+  *REGION_ALLOC(&worklist, struct work_item, 1) = (struct work_item) {
+    .term = term,
+    .next_let = term->lets,
   };
+
+  for (;;) {
+    struct work_item *item = &items[cur];
+    if (item->next_let) {
+      // Compile the next let first
+      ir val = item->next_let->val;
+      item->next_let = item->next_let->next;
+      *REGION_ALLOC(&worklist, struct work_item, 1) = (struct work_item) {
+        .term = val,
+        .next_let = val->lets,
+        .parent = cur,
+      };
+      cur = (struct work_item *) worklist.top - items - 1;
+      continue;
+    }
+
+    // All its lets are compiled, and their results are just above it
+    assert((struct work_item *) worklist.top - item == 1 + item->term->lets_len);
+    compile_one(item, cur == 0);
+    worklist.top = (uint8_t *) &item[1];
+
+    if (cur == 0)
+      return item->result;
+    cur = item->parent;
+  }
 }
 
 void *compile_toplevel(ir term) {
   init_code_buf();
   assert(term->lvl == 0);
-  struct compile_result res = compile(NULL, term);
-  assert(res.env->envc == 0);
-  free(res.env);
+  if (!scratch.start)
+    region_init(&scratch, SCRATCH_BYTES);
+  if (lazy_compile && !lazy_area.start) {
+    region_init(&lazy_area, SCRATCH_BYTES);
+    region_init(&staging, code_buf_end - code_buf_start);
+  }
+  region_init(&worklist, SCRATCH_BYTES);
+  struct compile_result res = compile(term);
+  assert(res.env.envc == 0);
+  region_free(&worklist);
+  // Lazily compiled closures still need the scratch space
+  if (lazy_area.start)
+    scratch.top = scratch.start;
+  else
+    region_free(&scratch);
   return res.code;
 }
-
@@ -1,14 +1,58 @@
 #include <stddef.h>
+#include <stdbool.h>
 #include "frontend.h"
 
 /** Compile a top-level (closed, at level 0) term to machine code.
  *
  * It returns a void *. This is not executable until codegen_finalize is run.
+ * When compiling lazily, the IR has to stay around until compile_reset.
  */
 void *compile_toplevel(ir term);
 
-/** Remap the codegen'd area from RW to RX.
+/** Register the codegen'd area with the runtime.
  *
  * You may now cast the void *'s from codegen_toplevel to void(*)(void)
  */
 void compile_finalize(void);
+
+/** Throw away all the compiled code, to reuse the buffer.
+ *
+ * Nothing can refer to the old code anymore, including the runtime's heap.
+ * Past the first megabyte, the buffer's pages go back to the OS.
+ */
+void compile_reset(void);
+
+/** Compile only the top-level term up front, and the closures inside it the
+ * first time they're entered. This is for every thread.
+ *
+ * The code can then only run in the thread that compiled it.
+ */
+void compile_lazily(bool on);
+
+/** With lazy compilation, compile closures to count how often they're
+ * entered first, and compile them again once they're hot, using what they
+ * tail call.
+ */
+void compile_tiered(bool on);
+
+/** Store the free variables of thunks as 32-bit pointers, two to a word,
+ * when there are at least two. The code buffer gets mapped below 2G, and the
+ * runtime has to keep the heap there too, with rt_set_compressed. This has to
+ * be set before compiling anything.
+ */
+void compile_compressed(bool on);
+
+/** For compile-time benchmarks: what got compiled since the last reset.
+ */
+struct compile_stats {
+  // Bytes of code, in total and from setting up tail calls
+  size_t code_bytes;
+  size_t moves_bytes;
+  // Time spent in do_the_moves, if it's being timed
+  double moves_seconds;
+};
+void compile_stats(struct compile_stats *stats);
+
+/** Time each do_the_moves call, which is slow enough to skew the total.
+ */
+void compile_time_moves(bool on);
@@ -0,0 +1,140 @@
+/** Compile-time microbenchmarks, on synthetic terms (see gen.h).
+ *
+ * For each term, it times parsing (including lowering to IR), lowering on its
+ * own, and compiling, and separately do_the_moves within compiling. Times are
+ * per IR node, which is one for each lambda or application spine. It also
+ * reports how much code each IR node turns into. Timing do_the_moves means
+ * reading the clock twice per IR node, so it's done in separate runs, and the
+ * timer's overhead is included.
+ *
+ * Usage: build/compile-bench [DEPTH,WIDTH,FREE,ARITY ...]
+ *        build/compile-bench --print DEPTH,WIDTH,FREE,ARITY
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frontend.h"
+#include "backend.h"
+#include "gen.h"
+
+// Repeat each measurement for at least this long
+#define MIN_SECONDS 0.2
+
+// Deep, wide, capturing more and with more arguments
+static const struct gen_params default_params[] = {
+  { 1000, 1, 1, 1 }, { 2000, 1, 1, 1 }, { 4000, 1, 1, 1 }, { 8000, 1, 1, 1 },
+  { 1, 1000, 1, 1 }, { 1, 4000, 1, 1 }, { 2, 64, 1, 1 }, { 2, 128, 1, 1 },
+  { 10, 2, 1, 2 }, { 10, 2, 8, 2 }, { 10, 2, 64, 2 },
+  { 8, 2, 4, 0 }, { 8, 2, 4, 8 }, { 8, 2, 4, 32 }, { 8, 2, 4, 128 },
+};
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static size_t ir_nodes(ir term) {
+  size_t n = 1;
+  for (letlist l = term->lets; l; l = l->next)
+    n += ir_nodes(l->val);
+  return n;
+}
+
+static void bench(const struct gen_params *p) {
+  char *text = gen_source(p);
+  size_t text_len = strlen(text);
+
+  size_t reps = 0, nodes = 0;
+  double start = now(), parse_seconds;
+  do {
+    ir term = parse(text);
+    if (!term)
+      exit(1);
+    nodes = ir_nodes(term);
+    free_ir();
+    reps++;
+  } while ((parse_seconds = now() - start) < MIN_SECONDS);
+  parse_seconds /= reps;
+
+  reps = 0;
+  start = now();
+  double lower_seconds;
+  do {
+    gen_ir(p);
+    free_ir();
+    reps++;
+  } while ((lower_seconds = now() - start) < MIN_SECONDS);
+  lower_seconds /= reps;
+
+  // Only the compiling gets timed
+  ir term = gen_ir(p);
+  struct compile_stats stats;
+  double compile_seconds = 0;
+  for (reps = 0; compile_seconds < MIN_SECONDS; reps++) {
+    start = now();
+    compile_toplevel(term);
+    compile_seconds += now() - start;
+    compile_stats(&stats);
+    compile_reset();
+  }
+  compile_seconds /= reps;
+
+  compile_time_moves(true);
+  double moves_seconds = 0;
+  for (reps = 0; moves_seconds < MIN_SECONDS; reps++) {
+    compile_toplevel(term);
+    struct compile_stats timed;
+    compile_stats(&timed);
+    moves_seconds += timed.moves_seconds;
+    compile_reset();
+  }
+  moves_seconds /= reps;
+  compile_time_moves(false);
+  free_ir();
+  free(text);
+
+  double ns = 1e9 / nodes;
+  printf("%5u %5u %4u %5u %8zu %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+      p->depth, p->width, p->free_vars, p->arity, nodes,
+      parse_seconds * ns, text_len / parse_seconds * 1e-6, lower_seconds * ns,
+      compile_seconds * ns, moves_seconds * ns,
+      (double) stats.code_bytes / nodes, (double) stats.moves_bytes / nodes);
+  fflush(stdout);
+}
+
+static struct gen_params parse_params(const char *arg) {
+  struct gen_params p;
+  if (sscanf(arg, "%u,%u,%u,%u", &p.depth, &p.width, &p.free_vars,
+        &p.arity) != 4) {
+    fprintf(stderr, "Expected DEPTH,WIDTH,FREE,ARITY, got '%s'\n", arg);
+    exit(1);
+  }
+  return p;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "--print") == 0) {
+    struct gen_params p = parse_params(argv[2]);
+    fputs(gen_source(&p), stdout);
+    return 0;
+  }
+
+  printf("%5s %5s %4s %5s %8s %8s %8s %8s %8s %8s %8s %8s\n", "depth",
+      "width", "free", "arity", "nodes", "parse", "MB/s", "lower", "compile",
+      "moves", "code", "moves");
+  printf("%28s %8s %8s %8s %8s %8s %8s %8s\n", "", "ns/node", "", "ns/node",
+      "ns/node", "ns/node", "B/node", "B/node");
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      struct gen_params p = parse_params(argv[i]);
+      bench(&p);
+    }
+  } else {
+    for (size_t i = 0; i < sizeof(default_params) / sizeof(default_params[0]); i++)
+      bench(&default_params[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Compile time scaling on deeply nested terms:
+#
+#   λ top. top (λ x. x (λ x. x (... (λ x. x top))))
+#
+# Every closure captures 'top' from the outermost binder, so the whole thing
+# should compile (and run) in time linear in the depth.
+#
+# Usage: bench/deep.sh [./lc] [depths...]
+
+LC=${1:-./lc}
+[ $# -gt 0 ] && shift
+DEPTHS=${*:-1000 2000 4000 8000 16000 32000 64000}
+
+# The parser and printer recurse on the native stack
+ulimit -s unlimited 2>/dev/null || ulimit -s 1048576
+
+term() {
+  printf 'λ top. top ('
+  printf 'λ x. x (%.0s' $(seq "$1")
+  printf 'top'
+  printf ')%.0s' $(seq "$1")
+  printf ')\n'
+}
+
+printf '%8s %10s %12s\n' depth seconds ns/binder
+for n in $DEPTHS; do
+  term "$n" > /tmp/lc-deep.$$
+  start=$(date +%s%N)
+  "$LC" - < /tmp/lc-deep.$$ > /dev/null || { echo "$LC failed at depth $n"; break; }
+  end=$(date +%s%N)
+  awk -v n="$n" -v ns=$((end - start)) \
+    'BEGIN { printf "%8d %10.4f %12d\n", n, ns / 1e9, ns / n }'
+done
+rm -f /tmp/lc-deep.$$
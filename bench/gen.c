@@ -0,0 +1,90 @@
+#include "gen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct buf {
+  char *data;
+  size_t len, cap;
+};
+
+static void put(struct buf *b, const char *s) {
+  size_t n = strlen(s);
+  if (b->len + n + 1 > b->cap) {
+    b->cap = 2 * (b->len + n + 1);
+    b->data = realloc(b->data, b->cap);
+    if (!b->data) {
+      fprintf(stderr, "Couldn't allocate the term\n");
+      abort();
+    }
+  }
+  memcpy(b->data + b->len, s, n + 1);
+  b->len += n;
+}
+
+// Names have no digits in them: a, b, …, z, ba, bb, …
+static void put_var(struct buf *b, var v) {
+  char name[16];
+  int i = sizeof(name) - 1;
+  name[i] = '\0';
+  do {
+    name[--i] = 'a' + v % 26;
+    v /= 26;
+  } while (v);
+  put(b, " ");
+  put(b, &name[i]);
+}
+
+// The i'th argument at a node whose y is at level y
+static var arg_var(const struct gen_params *p, var y, unsigned int i) {
+  return p->free_vars ? (y + i) % p->free_vars : y;
+}
+
+static void node_source(const struct gen_params *p, struct buf *b,
+    unsigned int depth, var y) {
+  put(b, " (λ");
+  put_var(b, y);
+  put(b, ".");
+  put_var(b, y);
+  for (unsigned int i = 0; i < p->arity; i++)
+    put_var(b, arg_var(p, y, i));
+  if (depth) {
+    for (unsigned int i = 0; i < p->width; i++)
+      node_source(p, b, depth - 1, y + 1);
+  }
+  put(b, ")");
+}
+
+char *gen_source(const struct gen_params *p) {
+  struct buf b = { 0 };
+  if (p->free_vars) {
+    put(&b, "λ");
+    for (var v = 0; v < p->free_vars; v++)
+      put_var(&b, v);
+    put(&b, ".");
+  }
+  node_source(p, &b, p->depth, p->free_vars);
+  put(&b, "\n");
+  return b.data;
+}
+
+static ir node_ir(const struct gen_params *p, unsigned int depth, var y) {
+  size_t lvl = y + 1;
+  ir body = mkvar(lvl, y);
+  for (unsigned int i = 0; i < p->arity; i++)
+    body = mkapp(lvl, body, mkvar(lvl, arg_var(p, y, i)));
+  if (depth) {
+    for (unsigned int i = 0; i < p->width; i++)
+      body = mkapp(lvl, body, node_ir(p, depth - 1, y + 1));
+  }
+  return mkabs(y, body);
+}
+
+ir gen_ir(const struct gen_params *p) {
+  ir_begin();
+  ir term = node_ir(p, p->depth, p->free_vars);
+  for (var v = p->free_vars; v > 0; v--)
+    term = mkabs(v - 1, term);
+  return term;
+}
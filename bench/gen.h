@@ -0,0 +1,31 @@
+#ifndef GEN_H
+#define GEN_H 1
+
+#include "frontend.h"
+
+/** Synthetic terms, for compile-time benchmarks.
+ *
+ * With F free variables, A arguments and width W, the term is
+ *
+ *   λ f_1 … f_F. N(depth)
+ *
+ * where N(0) = λ y. y a_1 … a_A
+ *       N(d) = λ y. y a_1 … a_A N(d-1) … N(d-1)   (W copies)
+ *
+ * and the a_i are the f's, or y if there aren't any. So there are about W^depth
+ * closures, and they all capture up to F variables from the outermost binders.
+ */
+struct gen_params {
+  unsigned int depth;
+  unsigned int width;
+  unsigned int free_vars;
+  unsigned int arity;
+};
+
+// The term as source text, malloc'd
+char *gen_source(const struct gen_params *p);
+
+// The same term, built straight into IR
+ir gen_ir(const struct gen_params *p);
+
+#endif // GEN_H
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Parallel normalization of a wide normal form: a complete binary tree of
+# depth 6, with 4^7 at each leaf.
+#
+# Usage: bench/parallel.sh [./lc] [thread counts...]
+
+LC=${1:-./lc}
+[ $# -gt 0 ] && shift
+THREADS=${*:-1 2 4 8 16 32}
+
+TERM='(λ four six seven. six (λ t f. f t t) (seven four))
+  (λ s z. s (s (s (s z))))
+  (λ s z. s (s (s (s (s (s z))))))
+  (λ s z. s (s (s (s (s (s (s z)))))))'
+
+printf '%8s %10s\n' threads seconds
+for n in $THREADS; do
+  start=$(date +%s%N)
+  "$LC" --threads "$n" "$TERM" > /dev/null || { echo "$LC failed"; break; }
+  end=$(date +%s%N)
+  awk -v n="$n" -v ns="$((end - start))" 'BEGIN { printf "%8d %10.3f\n", n, ns / 1e9 }'
+done
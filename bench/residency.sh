@@ -0,0 +1,36 @@
+#!/bin/sh
+# Major GC pauses with lots of live data, against the number of GC threads,
+# with incremental major GCs and with the mark-region old space.
+#
+# The term builds a list of 2^K cells and walks it twice, so all of it stays
+# live until the second walk. K=23 keeps a few hundred MB live.
+#
+# Usage: bench/residency.sh [./lc] [K]
+
+LC=${1:-./lc}
+K=${2:-23}
+
+size='λ f z. f z'
+i=0
+while [ $i -lt "$K" ]; do
+  size="(λ n f z. n f (n f z)) ($size)"
+  i=$((i + 1))
+done
+
+walk='size (λ k m. m (λ h t. k t) nil) (λ m. m) l'
+term="(λ size one. (λ nil cons. (λ l. λ p. p ($walk) ($walk))
+  (size (λ rest. cons one rest) nil)) (λ c n. n) (λ h t c n. c h t))
+  ($size) (λ x. x)"
+
+for threads in 1 2 4 8; do
+  echo "$threads GC threads:"
+  "$LC" --gc-stats --gc-threads "$threads" "$term" 2>&1 >/dev/null
+done
+
+for ms in 2 10; do
+  echo "Incremental, aiming for ${ms}ms pauses:"
+  "$LC" --gc-stats --gc-pause "$ms" "$term" 2>&1 >/dev/null
+done
+
+echo "Mark-region:"
+"$LC" --gc-stats --gc-mark-region "$term" 2>&1 >/dev/null
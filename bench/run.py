@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+"""Benchmark harness: runs the programs in bench/corpus and bench.lc.
+
+Each program runs a few times with lc --stats. The median run by wall time
+gets reported, as JSON on stdout: wall time, compile, run and print times,
+bytes allocated, GC counts, max live data after a major GC and max RSS.
+
+If haskell/Weak and haskell/Strong are built (make -C haskell), they get
+timed too. They compute the same thing as bench.lc.
+
+Each --flag gets passed on to lc, e.g. --flag=--gc-mark-region to run the
+corpus with the other old space.
+
+With --compare OLD.json, it also prints the ratios against an older run to
+stderr, and exits with status 1 if anything got slower or allocates more by
+more than the threshold.
+
+Usage: bench/run.py [--lc ./lc] [--flag FLAG]... [--runs N]
+                    [--compare OLD.json] [--threshold 0.1] [names...]
+"""
+
+import argparse
+import glob
+import json
+import os
+import statistics
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+HASKELL = {'haskell-weak': 'Weak', 'haskell-strong': 'Strong'}
+# What the Haskell programs compute
+HASKELL_BASELINE = 'bench'
+# The fields to check for regressions, and what counts as a regression
+CHECKED = ['wall_seconds', 'allocated_bytes', 'max_live_bytes']
+
+
+def programs():
+    progs = {'bench': os.path.join(ROOT, 'bench.lc')}
+    for path in sorted(glob.glob(os.path.join(ROOT, 'bench', 'corpus', '*.lc'))):
+        progs[os.path.splitext(os.path.basename(path))[0]] = path
+    return progs
+
+
+def run_once(argv, stdin_path=None):
+    """Returns the wall time, max RSS in bytes and stderr of one run."""
+    stdin = open(stdin_path, 'rb') if stdin_path else subprocess.DEVNULL
+    start = time.monotonic()
+    proc = subprocess.Popen(argv, stdin=stdin, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE)
+    err = proc.stderr.read()
+    _, status, rusage = os.wait4(proc.pid, 0)
+    wall = time.monotonic() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if stdin_path:
+        stdin.close()
+    if proc.returncode != 0:
+        raise RuntimeError(f'{" ".join(argv)} failed:\n{err.decode()}')
+    return wall, rusage.ru_maxrss * 1024, err.decode()
+
+
+def measure(argv, runs, stdin_path=None, stats=True):
+    results = []
+    for _ in range(runs):
+        wall, rss, err = run_once(argv, stdin_path)
+        result = {'wall_seconds': wall, 'max_rss_bytes': rss}
+        if stats:
+            line = [l for l in err.splitlines() if l.startswith('{')][-1]
+            result.update(json.loads(line))
+        results.append(result)
+    results.sort(key=lambda r: r['wall_seconds'])
+    median = dict(results[len(results) // 2])
+    median['wall_seconds_min'] = results[0]['wall_seconds']
+    median['wall_seconds_max'] = results[-1]['wall_seconds']
+    median['runs'] = runs
+    return median
+
+
+def compare(results, old, threshold):
+    """Prints the ratios against the old results. Returns whether anything
+    regressed."""
+    regressed = False
+    print(f'{"":16}' + ''.join(f'{f:>18}' for f in CHECKED), file=sys.stderr)
+    for name, new in results.items():
+        if name not in old:
+            continue
+        row = f'{name:16}'
+        for field in CHECKED:
+            if field not in new or not old[name].get(field):
+                row += f'{"-":>18}'
+                continue
+            ratio = new[field] / old[name][field]
+            bad = ratio > 1 + threshold
+            regressed |= bad
+            row += f'{ratio:>17.3f}' + ('!' if bad else ' ')
+        print(row, file=sys.stderr)
+    return regressed
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Run the benchmark corpus and print JSON results')
+    parser.add_argument('--lc', default=os.path.join(ROOT, 'lc'))
+    parser.add_argument('--flag', action='append', default=[],
+                        help='pass this flag to lc too')
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('--compare', metavar='OLD.json')
+    parser.add_argument('--threshold', type=float, default=0.1,
+                        help='relative change that counts as a regression')
+    parser.add_argument('names', nargs='*')
+    args = parser.parse_args()
+
+    progs = programs()
+    names = args.names or list(progs) + list(HASKELL)
+    results = {}
+    for name in names:
+        if name in HASKELL:
+            exe = os.path.join(ROOT, 'haskell', HASKELL[name])
+            if not os.path.exists(exe):
+                continue
+            result = measure([exe], args.runs, stats=False)
+            result['baseline'] = HASKELL_BASELINE
+        elif name in progs:
+            result = measure([args.lc, '--stats', *args.flag, '-'], args.runs,
+                             progs[name])
+        else:
+            sys.exit(f'No benchmark called {name}')
+        results[name] = result
+        print(f'{name}: {result["wall_seconds"]:.3f} s', file=sys.stderr,
+              flush=True)
+
+    json.dump({'lc': args.lc, 'flags': args.flag, 'results': results},
+              sys.stdout, indent=2)
+    print()
+
+    if args.compare:
+        with open(args.compare) as f:
+            old = json.load(f)['results']
+        if compare(results, old, args.threshold):
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
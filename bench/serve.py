@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""Load generator for lc --serve.
+
+Starts the server with each number of workers, and has as many clients each
+send the same term over and over for a few seconds. Prints the throughput;
+the server prints its latency percentiles when it's stopped.
+
+Usage: bench/serve.py [./lc] [TERM]
+"""
+
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+LC = sys.argv[1] if len(sys.argv) > 1 else './lc'
+TERM = sys.argv[2] if len(sys.argv) > 2 else \
+    '(λ s z. s (s (s z))) (λ s z. s (s z)) (λ s z. s (s (s (s z))))'
+SECONDS = 3
+STATUSES = ['ok', 'budget exceeded', 'out of memory', 'parse error', 'too big']
+
+
+def request(sock, term):
+    data = term.encode()
+    sock.sendall(struct.pack('<I', len(data)) + data)
+    status, = struct.unpack('<I', recv_exactly(sock, 4))
+    if status != 0:
+        raise RuntimeError(STATUSES[status])
+    out = b''
+    while True:
+        length, = struct.unpack('<I', recv_exactly(sock, 4))
+        if length == 0:
+            return out
+        out += recv_exactly(sock, length)
+
+
+def recv_exactly(sock, n):
+    buf = b''
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise EOFError
+        buf += chunk
+    return buf
+
+
+def client(path, deadline, counts, i):
+    with socket.socket(socket.AF_UNIX) as sock:
+        sock.connect(path)
+        while time.monotonic() < deadline:
+            request(sock, TERM)
+            counts[i] += 1
+
+
+def run(workers):
+    path = os.path.join(tempfile.mkdtemp(), 'lc.sock')
+    server = subprocess.Popen([LC, '--serve', path, '--workers', str(workers)])
+    while not os.path.exists(path):
+        time.sleep(0.01)
+
+    counts = [0] * workers
+    deadline = time.monotonic() + SECONDS
+    threads = [threading.Thread(target=client, args=(path, deadline, counts, i))
+               for i in range(workers)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    print(f'{workers} workers: {sum(counts) / SECONDS:.1f} requests/s', flush=True)
+    server.send_signal(signal.SIGINT)
+    server.wait()
+
+
+for workers in [1, 2, 4, 8, 16, 32]:
+    if workers > 1 and workers > 2 * os.cpu_count():
+        break
+    run(workers)
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Time scaling on wide neutral terms, built one argument at a time:
+#
+#   λ x a. x a a ... a    (2^K arguments)
+#
+# Each step applies a rigid term to one more argument, so the whole thing
+# should run in time linear in the number of arguments.
+#
+# Usage: bench/spine.sh [./lc] [K...]
+
+LC=${1:-./lc}
+[ $# -gt 0 ] && shift
+KS=${*:-10 12 14 16 18}
+
+term() {
+  size='λ f z. f z'
+  i=0
+  while [ $i -lt "$1" ]; do
+    size="(λ n f z. n f (n f z)) ($size)"
+    i=$((i + 1))
+  done
+  echo "(λ n. λ x a. n (λ f. f a) x) ($size)"
+}
+
+printf '%8s %10s %12s\n' args seconds ns/arg
+for k in $KS; do
+  n=$((1 << k))
+  t=$(term "$k")
+  start=$(date +%s%N)
+  "$LC" "$t" > /dev/null || { echo "$LC failed with $n args"; break; }
+  end=$(date +%s%N)
+  awk -v n="$n" -v ns=$((end - start)) \
+    'BEGIN { printf "%8d %10.4f %12d\n", n, ns / 1e9, ns / n }'
+done
@@ -18,13 +18,9 @@ static void arena_init(void);
 static bool is_var(ir e);
 static bool is_lambda(ir e);
 
-static ir mkvar(size_t lvl, var v);
-static ir mkapp(size_t lvl, ir func, ir arg);
-static ir mkabs(size_t lvl, ir body);
-
-static size_t *ir_arena_start = NULL;
-static size_t *ir_arena = NULL;
-static size_t *ir_arena_end = NULL;
+static __thread size_t *ir_arena_start = NULL;
+static __thread size_t *ir_arena = NULL;
+static __thread size_t *ir_arena_end = NULL;
 #define IR_ARENA_SIZE (32 * 1024 * 1024)
 
 static void arena_init(void) {
@@ -34,6 +30,10 @@ static void arena_init(void) {
   }
 }
 
+void ir_begin(void) {
+  arena_init();
+}
+
 void free_ir(void) {
   free(ir_arena_start);
   ir_arena = ir_arena_end = NULL;
@@ -53,7 +53,7 @@ static letlist cons_let(ir val, letlist next) {
   ARENA_ALLOC(struct a_let, val, next)
 }
 
-static ir mkvar(size_t lvl, var v) {
+ir mkvar(size_t lvl, var v) {
   ARENA_ALLOC(struct exp, lvl, 0, NULL, NULL, 0, v, NULL);
 }
 #undef ARENA_ALLOC
@@ -65,14 +65,14 @@ static bool is_lambda(ir e) {
   return e->arity > 0;
 }
 
-static ir mkabs(size_t lvl, ir body) {
+ir mkabs(size_t lvl, ir body) {
   assert(body->lvl == lvl + 1);
   body->lvl = lvl;
   body->arity++;
   return body;
 }
 
-static ir mkapp(size_t lvl, ir func, ir arg) {
+ir mkapp(size_t lvl, ir func, ir arg) {
   if (is_lambda(func)) {
     if (is_var(arg)) {
       // Applying a lambda to a var: let f = func in f x
@@ -139,8 +139,8 @@ static ir parse_exp(const char **cursor, size_t lvl, scope s);
 static ir parse_atomic_exp(const char **cursor, size_t lvl, scope s);
 static ir parse_rest_of_lambda(const char **cursor, size_t lvl, scope s);
 
-static const char *err_msg = NULL;
-static const char *err_loc = NULL;
+static __thread const char *err_msg = NULL;
+static __thread const char *err_loc = NULL;
 
 
 ir parse(const char *text) {
@@ -39,6 +39,16 @@ ir parse(const char *text);
  */
 void free_ir(void);
 
+/** Lowering to IR, which the parser does as it goes.
+ *
+ * lvl is the number of binders in scope, and variables are de Bruijn levels.
+ * Call ir_begin before building any IR without the parser
+ */
+void ir_begin(void);
+ir mkvar(size_t lvl, var v);
+ir mkapp(size_t lvl, ir func, ir arg);
+ir mkabs(size_t lvl, ir body);
+
 /** For debugging purposes
  */
 void print_ir(ir term);
@@ -1,28 +1,435 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "frontend.h"
 #include "backend.h"
 #include "runtime/normalize.h"
+#include "server.h"
+#include "timings.h"
+
+// Read all of stdin into a malloc'd, null-terminated string
+static char *read_stdin(void) {
+  size_t len = 0, cap = 4096;
+  char *buf = malloc(cap);
+  size_t n;
+  while ((n = fread(buf + len, 1, cap - len - 1, stdin)) > 0) {
+    len += n;
+    if (cap - len == 1)
+      buf = realloc(buf, cap *= 2);
+  }
+  buf[len] = '\0';
+  return buf;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+      "Usage: %s [options] [TERM | -]\n"
+      "       %s --equal TERM TERM\n"
+      "       %s --serve SOCKET [--workers N]\n"
+      "\n"
+      "Normalizes TERM, or the term on stdin if given '-'.\n"
+      "With --equal, checks whether two terms have the same normal form,\n"
+      "exiting with status 0 if they do and 1 if they don't.\n"
+      "With --serve, normalizes terms sent to a Unix socket, with N worker\n"
+      "threads (by default, one per core).\n"
+      "\n"
+      "Options:\n"
+      "  --syntax SYNTAX  print the normal form as 'named' (the default),\n"
+      "                   'debruijn' or 'sexp'\n"
+      "  --bench-print    measure how fast the normal form prints\n"
+      "  --depth N        only evaluate N head normal forms deep, printing\n"
+      "                   the rest as '…'\n"
+      "  --max-alloc N    give up after allocating N bytes\n"
+      "  --max-gcs N      give up after N garbage collections\n"
+      "  --timeout SECS   give up after SECS seconds\n"
+      "  --max-heap N     use at most about N bytes of heap\n"
+      "  --threads N      normalize with N threads\n"
+      "  --eager          compile every closure up front, instead of the\n"
+      "                   first time it runs\n"
+      "  --tiered         count how often closures run, and compile the hot\n"
+      "                   ones again with what their calls went to\n"
+      "  --gc-threads N   use N threads in major GCs of big heaps\n"
+      "  --gc-pause MS    do major GCs incrementally, with pauses of about\n"
+      "                   MS milliseconds\n"
+      "  --tenure N       promote objects after N minor GCs (default 1)\n"
+      "  --gc-mark-region use a mark-region old space, which doesn't copy\n"
+      "                   long-lived objects in major GCs\n"
+      "  --compress       store the free variables of thunks as 32-bit\n"
+      "                   pointers, keeping the heap below 2G\n"
+      "  --gc-stats       print GC statistics to stderr\n"
+      "  --stats          print times and GC counts to stderr as JSON\n"
+      "  --timings        print the time and hardware counters for each\n"
+      "                   phase to stderr\n"
+      "  --timings-json   the same, as one line of JSON\n"
+      "\n"
+      "Giving up exits with status 3, and running out of memory with 4.\n",
+      prog, prog, prog);
+  exit(1);
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Print the normal form to /dev/null over and over, in each syntax
+static void bench_print(unsigned int *nf) {
+  static const char *names[] = {
+    [SYNTAX_NAMED] = "named",
+    [SYNTAX_DE_BRUIJN] = "debruijn",
+    [SYNTAX_SEXP] = "sexp",
+  };
+  int fd = open("/dev/null", O_WRONLY);
+  if (fd < 0) {
+    perror("/dev/null");
+    exit(1);
+  }
+  for (enum nf_syntax syntax = 0; syntax <= SYNTAX_SEXP; syntax++) {
+    size_t tokens = 0, reps = 0;
+    double start = now(), elapsed;
+    do {
+      tokens += write_normal_form(fd, nf, syntax);
+      reps++;
+    } while ((elapsed = now() - start) < 1.0);
+    printf("%-8s  %zu tokens  %.1f Mtokens/s\n", names[syntax],
+        tokens / reps, tokens / elapsed * 1e-6);
+  }
+  close(fd);
+}
+
+static void runtime_failed(enum rt_status status) {
+  if (status == RT_OUT_OF_MEMORY) {
+    fprintf(stderr, "Out of memory\n");
+    exit(4);
+  }
+  fprintf(stderr, "Budget exceeded\n");
+  exit(3);
+}
+
+// Growable buffer of unsigned ints
+struct uint_vec {
+  unsigned int *data;
+  size_t len, cap;
+};
+
+static void uint_vec_push(struct uint_vec *v, unsigned int x) {
+  if (v->len == v->cap) {
+    size_t new_cap = 2 * v->cap + 16;
+    unsigned int *new_data =
+      reallocarray(v->data, new_cap, sizeof(unsigned int));
+    if (!new_data)
+      runtime_failed(RT_OUT_OF_MEMORY);
+    v->data = new_data;
+    v->cap = new_cap;
+  }
+  v->data[v->len++] = x;
+}
+
+static void print_gc_stats(void) {
+  struct gc_stats stats;
+  rt_gc_stats(&stats);
+  fprintf(stderr, "%zu minor GCs, %zu major GCs, %zu incremental major GCs\n"
+      "major GC pauses: %.1f ms total, %.1f ms max\n"
+      "max live data: %.1f MB\n"
+      "promoted: %.1f MB, %.1f MB of it early for lack of survivor space\n"
+      "pauses:\n",
+      stats.minor_gcs, stats.major_gcs, stats.incremental_gcs,
+      stats.major_seconds * 1e3, stats.max_major_seconds * 1e3,
+      stats.max_live_bytes / 1e6, stats.promoted_bytes / 1e6,
+      stats.premature_bytes / 1e6);
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (stats.pauses[i])
+      fprintf(stderr, "  %8zu-%zu us: %zu\n", (size_t) 1 << i,
+          (size_t) 2 << i, stats.pauses[i]);
+  }
+}
+
+// One line of JSON, for bench/run.py
+static void print_stats(double compile_seconds, double run_seconds,
+    double print_seconds) {
+  struct gc_stats stats;
+  rt_gc_stats(&stats);
+  fprintf(stderr, "{\"compile_seconds\": %.6f, \"run_seconds\": %.6f, "
+      "\"print_seconds\": %.6f, \"allocated_bytes\": %zu, "
+      "\"minor_gcs\": %zu, \"major_gcs\": %zu, \"incremental_gcs\": %zu, "
+      "\"major_gc_seconds\": %.6f, \"max_live_bytes\": %zu}\n",
+      compile_seconds, run_seconds, print_seconds, stats.allocated_bytes,
+      stats.minor_gcs, stats.major_gcs, stats.incremental_gcs,
+      stats.major_seconds, stats.max_live_bytes);
+}
+
+// Evaluate the term up to a depth of n head normal forms, and return the
+// partial normal form with holes for the rest
+static unsigned int *explore(void (*code)(void), unsigned int n) {
+  struct todo {
+    nf_handle term;
+    unsigned int depth;
+  };
+  size_t stack_len = 0, stack_cap = 64;
+  struct todo *stack = malloc(sizeof(struct todo[stack_cap]));
+  if (!stack)
+    runtime_failed(RT_OUT_OF_MEMORY);
+  stack[stack_len++] = (struct todo) { hnf_root(code), n };
+
+  struct uint_vec out = { 0 };
+  unsigned int next_var = 0;
+  while (stack_len) {
+    struct todo t = stack[--stack_len];
+    if (t.depth == 0) {
+      uint_vec_push(&out, HOLE);
+      hnf_release(t.term);
+      continue;
+    }
+
+    struct hnf hnf;
+    enum rt_status status = hnf_force(t.term, next_var, &hnf);
+    if (status != RT_OK)
+      runtime_failed(status);
+    hnf_release(t.term);
+    for (unsigned int i = 0; i < hnf.lams; i++) {
+      uint_vec_push(&out, LAM);
+      uint_vec_push(&out, next_var++);
+    }
+    uint_vec_push(&out, NE);
+    uint_vec_push(&out, hnf.argc);
+    uint_vec_push(&out, hnf.head);
+
+    // Push the args backwards, so the first one comes out first
+    if (stack_len + hnf.argc > stack_cap) {
+      stack_cap = 2 * (stack_len + hnf.argc);
+      struct todo *new_stack =
+        reallocarray(stack, stack_cap, sizeof(struct todo));
+      if (!new_stack)
+        runtime_failed(RT_OUT_OF_MEMORY);
+      stack = new_stack;
+    }
+    for (unsigned int i = hnf.argc; i-- > 0;)
+      stack[stack_len++] = (struct todo) { hnf.args[i], t.depth - 1 };
+    free(hnf.args);
+  }
+
+  free(stack);
+  return out.data;
+}
+
+static int check_equal(int argc, const char **argv, int n, const char *sources[n]) {
+  if (n != 2)
+    usage(argv[0]);
+
+  ir term1 = parse(sources[0]);
+  if (!term1)
+    return 2;
+  void *code1 = compile_toplevel(term1);
+  ir term2 = parse(sources[1]);
+  if (!term2)
+    return 2;
+  void *code2 = compile_toplevel(term2);
+  compile_finalize();
+
+  bool equal;
+  enum rt_status status = convertible(code1, code2, &equal);
+  free_ir();
+  if (status != RT_OK)
+    runtime_failed(status);
+  printf(equal ? "Equal\n" : "Not equal\n");
+  return equal ? 0 : 1;
+}
 
 int main(int argc, const char **argv) {
-  const char *source = argc >= 2 ? argv[1] : "λ x. x";
+  const char *source = "λ x. x";
+  enum nf_syntax syntax = SYNTAX_NAMED;
+  bool do_bench_print = false;
+  bool do_equal = false;
+  bool limit_depth = false;
+  unsigned int depth = 0;
+  struct rt_limits limits = { 0 };
+  const char *socket_path = NULL;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = 1;
+  bool gc_stats = false;
+  bool stats = false;
+  bool timings = false, timings_json = false;
+  bool eager = false, tiered = false;
+  const char *sources[2];
+  int n_sources = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--syntax") == 0 && i + 1 < argc) {
+      const char *name = argv[++i];
+      if (strcmp(name, "named") == 0)
+        syntax = SYNTAX_NAMED;
+      else if (strcmp(name, "debruijn") == 0)
+        syntax = SYNTAX_DE_BRUIJN;
+      else if (strcmp(name, "sexp") == 0)
+        syntax = SYNTAX_SEXP;
+      else
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--bench-print") == 0) {
+      do_bench_print = true;
+    } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+      char *end;
+      depth = strtoul(argv[++i], &end, 10);
+      if (*end)
+        usage(argv[0]);
+      limit_depth = true;
+    } else if (strcmp(argv[i], "--max-alloc") == 0 && i + 1 < argc) {
+      char *end;
+      limits.alloc_bytes = strtoull(argv[++i], &end, 10);
+      if (*end)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--max-gcs") == 0 && i + 1 < argc) {
+      char *end;
+      limits.gcs = strtoull(argv[++i], &end, 10);
+      if (*end)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+      char *end;
+      limits.seconds = strtod(argv[++i], &end);
+      if (*end)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--max-heap") == 0 && i + 1 < argc) {
+      char *end;
+      rt_set_max_heap(strtoull(argv[++i], &end, 10));
+      if (*end)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      char *end;
+      workers = strtol(argv[++i], &end, 10);
+      if (*end || workers < 1)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      char *end;
+      threads = strtol(argv[++i], &end, 10);
+      if (*end || threads < 1)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc) {
+      char *end;
+      int gc_threads = strtol(argv[++i], &end, 10);
+      if (*end || gc_threads < 1)
+        usage(argv[0]);
+      rt_set_gc_threads(gc_threads);
+    } else if (strcmp(argv[i], "--gc-pause") == 0 && i + 1 < argc) {
+      char *end;
+      double ms = strtod(argv[++i], &end);
+      if (*end || ms <= 0)
+        usage(argv[0]);
+      rt_set_gc_pause_target(ms * 1e-3);
+    } else if (strcmp(argv[i], "--tenure") == 0 && i + 1 < argc) {
+      char *end;
+      int age = strtol(argv[++i], &end, 10);
+      if (*end || age < 1 || age > 255)
+        usage(argv[0]);
+      rt_set_tenure_age(age);
+    } else if (strcmp(argv[i], "--gc-mark-region") == 0) {
+      rt_set_mark_region(true);
+    } else if (strcmp(argv[i], "--compress") == 0) {
+      rt_set_compressed(true);
+      compile_compressed(true);
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      gc_stats = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "--timings") == 0) {
+      timings = true;
+    } else if (strcmp(argv[i], "--timings-json") == 0) {
+      timings = timings_json = true;
+    } else if (strcmp(argv[i], "--eager") == 0) {
+      eager = true;
+    } else if (strcmp(argv[i], "--tiered") == 0) {
+      tiered = true;
+    } else if (strcmp(argv[i], "--equal") == 0) {
+      do_equal = true;
+    } else if ((argv[i][0] == '-' && argv[i][1] == '-') || n_sources == 2) {
+      usage(argv[0]);
+    } else {
+      sources[n_sources++] = argv[i];
+    }
+  }
+
+  rt_set_limits(limits);
+  // Other threads can't compile the main thread's closures
+  compile_lazily(!eager && threads == 1);
+  compile_tiered(tiered);
+
+  if (socket_path) {
+    if (n_sources)
+      usage(argv[0]);
+    return serve(socket_path, workers, syntax);
+  }
+  if (do_equal)
+    return check_equal(argc, argv, n_sources, sources);
+  if (n_sources > 1)
+    usage(argv[0]);
+  if (n_sources == 1)
+    source = sources[0];
+
+  // '-' reads the term from stdin, for terms too big for the command line
+  if (strcmp(source, "-") == 0)
+    source = read_stdin();
 
   printf("Input: %s\n", source);
   printf("Compiling... ");
   fflush(stdout);
 
+  if (timings)
+    timings_init();
+
+  double compile_start = now();
+  timings_start(PHASE_PARSE);
   ir term = parse(source);
+  if (!term)
+    return 1;
+  timings_stop(PHASE_PARSE);
+  timings_start(PHASE_COMPILE);
   void *code = compile_toplevel(term);
+  timings_stop(PHASE_COMPILE);
+  timings_start(PHASE_FINALIZE);
   compile_finalize();
-  free_ir();
+  timings_stop(PHASE_FINALIZE);
 
   printf("Compiled! Normalizing...\n");
-  unsigned int *nf = normalize(code);
+  double run_start = now();
+  unsigned int *nf;
+  timings_start(PHASE_NORMALIZE);
+  if (limit_depth) {
+    nf = explore(code, depth);
+  } else {
+    enum rt_status status = normalize_parallel(code, threads, &nf);
+    if (status != RT_OK)
+      runtime_failed(status);
+  }
+  timings_stop(PHASE_NORMALIZE);
+  free_ir();
 
-  printf("Normal form: ");
-  print_normal_form(nf);
+  if (gc_stats)
+    print_gc_stats();
+
+  double print_start = now();
+  timings_start(PHASE_PRINT);
+  if (do_bench_print) {
+    bench_print(nf);
+  } else {
+    printf("Normal form: ");
+    fflush(stdout);
+    write_normal_form(STDOUT_FILENO, nf, syntax);
+  }
+  timings_stop(PHASE_PRINT);
+  if (stats)
+    print_stats(run_start - compile_start, print_start - run_start,
+        now() - print_start);
+  if (timings) {
+    struct gc_stats gc;
+    rt_gc_stats(&gc);
+    timings_print(stderr, timings_json, gc.gc_seconds);
+  }
 
   free(nf);
 }
-
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include "budget.h"
+#include "gc.h"
+#include "builtins.h"
+#include "normalize.h"
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ucontext.h>
+#include <pthread.h>
+
+// How often the timer keeps ticking after the deadline, until it's noticed
+#define TICK_NSEC (1000 * 1000)
+// After this many ticks in code that never reaches a heap check, give up on
+// heap checks and jump out from the signal handler
+#define MAX_TICKS 10
+
+__thread sigjmp_buf budget_exit;
+
+static struct rt_limits limits;
+static __thread bool active = false;
+// Why it jumped to budget_exit
+static __thread enum rt_status stop_status = RT_OK;
+static __thread size_t allocated;
+// Bytes of the nursery in use at the start, which don't count
+static __thread size_t already_allocated;
+static __thread size_t gcs;
+
+static __thread volatile sig_atomic_t out_of_time;
+static __thread volatile sig_atomic_t ticks;
+static __thread timer_t timer;
+static __thread bool have_timer = false;
+
+__thread uint8_t *rt_code_start;
+__thread uint8_t *rt_code_end;
+
+static pthread_once_t segv_handler_once = PTHREAD_ONCE_INIT;
+
+void rt_set_limits(struct rt_limits new_limits) {
+  limits = new_limits;
+}
+
+void rt_register_code(void *start, void *end) {
+  rt_code_start = start;
+  rt_code_end = end;
+}
+
+void rt_code_range(void **start, void **end) {
+  *start = rt_code_start;
+  *end = rt_code_end;
+}
+
+static void on_tick(int sig, siginfo_t *info, void *context) {
+  ucontext_t *uc = context;
+  uint8_t *pc = (uint8_t *) uc->uc_mcontext.gregs[REG_RIP];
+  out_of_time = true;
+
+  // Only generated code is sure to have the runtime's registers. Anywhere
+  // else, wait for the next tick
+  if (!active || pc < rt_code_start || pc >= rt_code_end)
+    return;
+
+  // Make the next heap check fail, so it calls the GC, which stops
+  uc->uc_mcontext.gregs[REG_R14] = (greg_t) UINTPTR_MAX;
+
+  // Code that doesn't allocate doesn't do heap checks
+  if (++ticks > MAX_TICKS) {
+    stop_status = RT_BUDGET_EXCEEDED;
+    siglongjmp(budget_exit, 1);
+  }
+}
+
+static void create_timer(void) {
+  struct sigaction sa = {
+    .sa_sigaction = on_tick,
+    .sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER,
+  };
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGALRM, &sa, NULL))
+    failwith("Couldn't set up the timer: %s\n", strerror(errno));
+
+  // Signal this thread, not the whole process
+  struct sigevent sev = {
+    .sigev_notify = SIGEV_THREAD_ID,
+    .sigev_signo = SIGALRM,
+  };
+  sev._sigev_un._tid = gettid();
+  if (timer_create(CLOCK_MONOTONIC, &sev, &timer))
+    failwith("Couldn't set up the timer: %s\n", strerror(errno));
+  have_timer = true;
+}
+
+static void on_segv(int sig, siginfo_t *info, void *context) {
+  if (gc_data_stack_fault(info->si_addr))
+    return;
+  if (!gc_stack_overflow(info->si_addr)) {
+    // Not an overflow: crash as usual when it returns and faults again
+    signal(SIGSEGV, SIG_DFL);
+    return;
+  }
+  if (active) {
+    stop_status = RT_OUT_OF_MEMORY;
+    siglongjmp(budget_exit, 1);
+  }
+  static const char msg[] = "Stack overflow\n";
+  write(STDERR_FILENO, msg, sizeof(msg) - 1);
+  abort();
+}
+
+static void install_segv_handler(void) {
+  struct sigaction sa = {
+    .sa_sigaction = on_segv,
+    .sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK,
+  };
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGSEGV, &sa, NULL))
+    failwith("Couldn't set up the stacks: %s\n", strerror(errno));
+}
+
+void budget_catch_stack_faults(void) {
+  pthread_once(&segv_handler_once, install_segv_handler);
+}
+
+void budget_start(void) {
+  allocated = 0;
+  already_allocated = (size_t) (nursery_start + NURSERY_BYTES / sizeof(word))
+    - (size_t) nursery_top;
+  gcs = 0;
+  out_of_time = false;
+  ticks = 0;
+  active = true;
+  heap_limit = budget_heap_limit();
+
+  if (limits.seconds > 0) {
+    if (!have_timer)
+      create_timer();
+    time_t secs = (time_t) limits.seconds;
+    struct itimerspec spec = {
+      .it_value = {
+        .tv_sec = secs,
+        .tv_nsec = (long) ((limits.seconds - secs) * 1e9),
+      },
+      .it_interval = { .tv_sec = 0, .tv_nsec = TICK_NSEC },
+    };
+    timer_settime(timer, 0, &spec, NULL);
+  }
+}
+
+enum rt_status budget_stop(void) {
+  active = false;
+  if (limits.seconds > 0) {
+    struct itimerspec spec = { 0 };
+    timer_settime(timer, 0, &spec, NULL);
+  }
+  heap_limit = budget_heap_limit();
+  enum rt_status status = stop_status;
+  stop_status = RT_OK;
+  return status;
+}
+
+void budget_destroy(void) {
+  if (have_timer)
+    timer_delete(timer);
+  have_timer = false;
+}
+
+void budget_gc(size_t bytes_allocated) {
+  if (!active)
+    return;
+  allocated += bytes_allocated - already_allocated;
+  already_allocated = 0;
+  gcs++;
+  if (out_of_time
+      || (limits.alloc_bytes && allocated >= limits.alloc_bytes)
+      || (limits.gcs && gcs > limits.gcs)) {
+    stop_status = RT_BUDGET_EXCEEDED;
+    siglongjmp(budget_exit, 1);
+  }
+}
+
+void rt_out_of_memory(void) {
+  if (!active)
+    failwith("Out of memory\n");
+  stop_status = RT_OUT_OF_MEMORY;
+  siglongjmp(budget_exit, 1);
+}
+
+word *budget_heap_limit(void) {
+  if (!active || !limits.alloc_bytes)
+    return nursery_start;
+  size_t left = limits.alloc_bytes - allocated;
+  if (left >= (size_t) nursery_top - (size_t) nursery_start)
+    return nursery_start;
+  return nursery_top - left / sizeof(word);
+}
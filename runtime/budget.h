@@ -0,0 +1,37 @@
+#include "runtime.h"
+#include "normalize.h"
+
+#include <setjmp.h>
+
+/** Fuel limits for calls into the runtime.
+ *
+ * None of them cost anything in generated code: the GC enforces them, and
+ * the heap limit register is what gets the generated code to call the GC.
+ * To stop after some number of bytes, the heap limit is moved up so that the
+ * GC runs right when the budget runs out. To stop after some time, a timer
+ * signal sets the heap limit register so that the next heap check fails.
+ */
+
+// Where the runtime jumps to when the budget runs out
+extern __thread sigjmp_buf budget_exit;
+
+// Start and stop counting for a call into the runtime. budget_stop returns
+// why it jumped to budget_exit, if it did
+void budget_start(void);
+enum rt_status budget_stop(void);
+// Free this thread's timer
+void budget_destroy(void);
+
+// Called by the GC with the bytes allocated since the last GC. Jumps to
+// budget_exit if the budget ran out
+void budget_gc(size_t bytes_allocated);
+
+// Jumps to budget_exit too, if it's running
+void rt_out_of_memory(void);
+
+// Handle SIGSEGVs from the stacks: stack overflows count as running out of
+// memory
+void budget_catch_stack_faults(void);
+
+// How far down the nursery can be used before calling the GC
+word *budget_heap_limit(void);
@@ -1,6 +1,20 @@
 #include "gc.h"
 #include "builtins.h"
 
+asm (
+  "  .text\n"
+  "  .globl rt_call_on_stack\n"
+  "rt_call_on_stack:\n"
+  // Generated code doesn't use rbp
+  "  push %rbp\n"
+  "  mov %rsp, %rbp\n"
+  "  mov %rsi, %rsp\n"
+  "  call *%rdi\n"
+  "  mov %rbp, %rsp\n"
+  "  pop %rbp\n"
+  "  ret\n"
+);
+
 void rt_gc(void) {
   minor_gc();
 }
@@ -10,7 +24,7 @@ void rt_too_few_args(void) {
     return;
   size_t size = argc + 3;
   obj *pap = alloc(rt_pap_entry, size);
-  *INFO_WORD(pap) = (struct info_word) { .size = size, .var = 0 };
+  set_info_word(pap, (struct info_word) { .size = size, .var = 0 });
   pap->contents[1] = (word) self;
   memcpy(&pap->contents[2], data_stack, sizeof(word[argc]));
   data_stack += argc;
@@ -23,7 +37,7 @@ void rt_update_thunk(void) {
   obj *thunk = *data_stack++;
   thunk->entrypoint = rt_ref_entry;
   thunk->contents[0] = (word) self;
-  if (!IS_YOUNG(thunk) && IS_YOUNG(self))
+  if (!IS_YOUNG(thunk) && (IS_YOUNG(self) || replicating))
     write_barrier(thunk);
 }
 
@@ -31,7 +45,7 @@ void rt_adjacent_update_frames(void) {
   obj *thunk = *data_stack;
   thunk->entrypoint = rt_ref_entry;
   thunk->contents[0] = (word) self;
-  if (!IS_YOUNG(thunk) && IS_YOUNG(self))
+  if (!IS_YOUNG(thunk) && (IS_YOUNG(self) || replicating))
     write_barrier(thunk);
   *data_stack = self;
 }
@@ -66,7 +80,7 @@ void rt_pap_entry_impl(void) {
   // Partial application: push the arguments onto the stack and tail call the
   // contained function
   obj *fun = (obj *) self->contents[1];
-  size_t extra_args = INFO_WORD(self)->size - 3;
+  size_t extra_args = info_word(self).size - 3;
   argc += extra_args;
   data_stack -= extra_args;
   memcpy(data_stack, &self->contents[2], sizeof(word[extra_args]));
@@ -75,29 +89,27 @@ void rt_pap_entry_impl(void) {
   return self->entrypoint();
 }
 
+// Rigid spine nodes have at most this many arguments each, to stay small
+// enough to allocate
+#define RIGID_CHUNK 1024
+
 ENTRY("rt_rigid_entry", 0, RIGID);
 void rt_rigid_entry_impl(void) {
-  // Rigid term: allocate a new rigid term with the new arguments
-  if (argc == 0)
-    return;
-
-  // TODO: make overflow checks more legit (should have a max term size)
-  uint32_t new_size = INFO_WORD(self)->size + argc;
-  if (new_size < argc) failwith("overflow");
-
-  obj *new = alloc(rt_rigid_entry, new_size);
-  *INFO_WORD(new) = (struct info_word) {
-    .size = new_size,
-    .var = INFO_WORD(self)->var,
-  };
-
-  size_t self_argc = INFO_WORD(self)->size - 2;
-  memcpy(&new->contents[1], &self->contents[1], sizeof(word[self_argc]));
-  memcpy(&new->contents[1 + self_argc], data_stack, sizeof(word[argc]));
-  data_stack += argc;
-  argc = 0;
-
-  self = new;
+  // Rigid term: add nodes with the new arguments to the spine, without
+  // copying the old ones
+  while (argc > 0) {
+    size_t n = argc < RIGID_CHUNK ? argc : RIGID_CHUNK;
+    obj *new = alloc(rt_rigid_entry, n + 3);
+    set_info_word(new, (struct info_word) {
+      .size = n + 3,
+      .var = info_word(self).var,
+    });
+    new->contents[1] = (word) self;
+    memcpy(RIGID_ARGS(new), data_stack, sizeof(word[n]));
+    data_stack += n;
+    argc -= n;
+    self = new;
+  }
 }
 
 ENTRY("rt_blackhole_entry", 0, BLACKHOLE);
@@ -1,3 +1,10 @@
+// Tell the runtime where this thread's generated code lives
+void rt_register_code(void *start, void *end);
+void rt_code_range(void **start, void **end);
+
+// Call generated code on another native stack
+void rt_call_on_stack(void (*entrypoint)(void), void *stack_top);
+
 void rt_gc(void);
 void rt_too_few_args(void);
 void rt_update_thunk(void);
@@ -2,6 +2,7 @@
 #define DATA_LAYOUT_H 1
 
 #include <stdint.h>
+#include <string.h>
 
 /************* Object layout ***********/
 
@@ -21,6 +22,11 @@ typedef struct obj {
 #define RIGID     4
 #define THUNK     5
 #define BLACKHOLE 6
+// Or'd into the tag of thunks with compressed free variables: 32-bit
+// pointers, two to a word. With an odd number of them, the last one is there
+// twice, so that every half of every word is a pointer. This is only with
+// --compress, which keeps the heap and the code below 2G
+#define COMPRESSED 0x100
 
 struct gc_data {
   /** Size of the whole object in words.
@@ -39,6 +45,35 @@ struct info_word {
   /** only in heap objects representing rigid terms */
   uint32_t var;
 };
-#define INFO_WORD(o) ((struct info_word *) &o->contents[0])
+// Read and write it with memcpy, since contents is words
+static inline struct info_word info_word(obj *o) {
+  struct info_word info;
+  memcpy(&info, &o->contents[0], sizeof(info));
+  return info;
+}
+static inline void set_info_word(obj *o, struct info_word info) {
+  memcpy(&o->contents[0], &info, sizeof(info));
+}
+
+// Fields of compressed thunks, counting by halfwords
+static inline obj *half_field(obj *o, size_t i) {
+  halfword h;
+  memcpy(&h, (uint8_t *) o->contents + sizeof(halfword[i]), sizeof(h));
+  return (obj *) (word) h;
+}
+static inline void set_half_field(obj *o, size_t i, obj *field) {
+  halfword h = (halfword) (word) field;
+  memcpy((uint8_t *) o->contents + sizeof(halfword[i]), &h, sizeof(h));
+}
+
+/* A rigid term `x a1 ... an` is a spine of RIGID objects. The variable x alone
+ * is [info], and applying a rigid term to more arguments adds a node
+ * [info, prev, args...] pointing back to it. Each node's info word has the
+ * variable of the head.
+ */
+#define RIGID_PREV(o) ((obj *) (o)->contents[1])
+#define RIGID_ARGS(o) (&(o)->contents[2])
+#define RIGID_NODE_ARGC(o) (info_word(o).size - 3)
+#define RIGID_IS_VAR(o) (info_word(o).size == 2)
 
 #endif // DATA_LAYOUT_H
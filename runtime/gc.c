@@ -1,31 +1,223 @@
 #include "gc.h"
 #include "builtins.h"
+#include "budget.h"
+#include "normalize.h"
+#include "region.h"
 
-enum gc_type { MAJOR, MINOR };
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+
+// Each GC picks its type once, so that copying an object doesn't have to
+// check which old space it's using. Mark-region major GCs are MARK, and minor
+// GCs that promote into the mark-region old space are REGION_MINOR
+enum gc_type { MAJOR = 0, MINOR = 1, MARK = 2, REGION_MINOR = 3 };
+#define IS_MINOR(type) ((type) & 1)
+struct gc_thread;
 static void major_gc(void);
-static obj *copy_to_old_space(obj *o, enum gc_type type);
+static void copy_major(void);
+static void mark_major(void);
+static obj *evacuate(obj *o, enum gc_type type);
+static obj *mark_or_move(obj *o);
 static void process_copy_stack(enum gc_type type);
-static void collect_roots(enum gc_type type);
+static void process_mark_stack(void);
+static bool scan_object(obj *o, enum gc_type type);
+static void collect_roots(enum gc_type type, struct gc_thread *t);
+static void parallel_copy(void);
+static void replicate_slice(double start, word *promoted, word *promoted_end);
+static void start_replicating(void);
+static void stop_replicating(void);
+static void init_stacks(void);
+static void release_stack(uint8_t *start, uint8_t *below);
+static void protect_data_stack(obj **from);
+
+// The most a minor GC can promote
+#define MAX_PROMOTED_BYTES (NURSERY_BYTES + SURVIVOR_BYTES)
+// Promote objects once they've survived this many minor GCs. Aging costs a
+// side table lookup and store per copied object, so it's opt-in
+#define DEFAULT_TENURE_AGE 1
+
+// Major GCs of at least this much use several threads
+#define PARALLEL_GC_MIN_BYTES (16 * 1024 * 1024)
+// Each GC thread takes this much of the to-space at a time to copy into
+#define GC_CHUNK_WORDS 4096
+
+__thread word *nursery_start;
+
+// The old space is [old_limit, old_start + old_alloc_size). Below old_limit
+// is extra room, so that major GCs don't run out of space
+static __thread word *old_start;
+static __thread word *old_limit;
+static __thread word *old_top;
+static __thread size_t old_alloc_size;
+static __thread word *other_old_start;
+static __thread size_t other_old_alloc_size;
+// How big the old space should be, growing as the live data grows
+static __thread size_t old_space_size;
+// The most each semispace can grow to
+static size_t max_old_space_size = SIZE_MAX;
+static int gc_threads = 1;
+// If not 0, do major GCs incrementally, aiming for pauses this short
+static double pause_target = 0;
+// Use the mark-region old space in region.c instead of the semispaces
+static bool mark_region = false;
+// Keep the heap below 2G, for compressed thunks
+static bool compress = false;
 
-static word *old_start;
-static word *old_top;
-static word *other_old_start;
-static size_t old_space_size;
-static size_t other_old_space_size;
+static __thread struct gc_stats stats;
 
 // Remembered set: a growable (malloc'd) vector of old objects 'REF ptr' that
 // point to the nursery
-static obj **remembered_set;
-static size_t remembered_set_size;
-static size_t remembered_set_cap;
+static __thread obj **remembered_set;
+static __thread size_t remembered_set_size;
+static __thread size_t remembered_set_cap;
 
 // Copy stack: during GC, a worklist of new to-space objects whose fields still
 // point to the from-space
-static obj **copy_stack;
-static size_t copy_stack_size;
-static size_t copy_stack_cap;
+static __thread obj **copy_stack;
+static __thread size_t copy_stack_size;
+static __thread size_t copy_stack_cap;
+
+// Gray list for incremental major GCs: replicas whose fields still point to
+// the from-space
+static __thread obj **gray;
+static __thread size_t gray_len;
+static __thread size_t gray_cap;
+
+// Survivor spaces: young objects get copied back and forth between them
+// until they've survived tenure_age minor GCs. The to-space is empty between
+// GCs. Each has a side table of the age of each object, by its first word
+static int tenure_age = DEFAULT_TENURE_AGE;
+static __thread word *survivor_start[2];
+static __thread uint8_t *survivor_ages[2];
+static __thread int to_survivor;
+static __thread word *survivor_top;
+// Bytes in use in the from-survivor space
+static __thread size_t survivor_used;
+// The tenure age for this minor GC
+static __thread int minor_tenure_age;
+
+static __thread obj **data_stack_end;
+// The start of the reservations, guard regions included
+static __thread uint8_t *data_stack_mem;
+static __thread uint8_t *frame_stack_mem;
+__thread uint8_t *frame_stack_top;
+// The SIGSEGV handler runs here, since the frame stack might be full
+static __thread void *signal_stack;
+// The part of the data stack from here up only pointed to old objects at the
+// last GC, and it's write-protected, so it still does until a write faults.
+// Minor GCs scan the data stack up to here
+static __thread obj **clean_start;
+// Just past the highest root that's still young after the roots get collected
+static __thread obj **dirty_end;
+
+// Roots held by C code: a growable vector with a free list. Free slots are
+// null
+static __thread obj **c_roots;
+static __thread size_t c_roots_len;
+static __thread size_t c_roots_cap;
+static __thread size_t *free_c_roots;
+static __thread size_t free_c_roots_len;
+
+// Memory for the young generation and the semispaces. With compressed
+// thunks, it's mapped below 2G
+static word *heap_alloc(size_t bytes) {
+  if (!compress)
+    return malloc(bytes);
+  void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static void heap_free(word *p, size_t bytes) {
+  if (!compress)
+    free(p);
+  else if (p)
+    munmap(p, bytes);
+}
+
+static void reset_nursery(void) {
+  nursery_top = nursery_start + NURSERY_BYTES / sizeof(word);
+  heap_limit = budget_heap_limit();
+}
+
+static void init_old_space(void) {
+  old_space_size = 2 * NURSERY_BYTES;
+  if (old_space_size > max_old_space_size)
+    old_space_size = max_old_space_size;
+  if (mark_region) {
+    old_start = old_limit = old_top = other_old_start = NULL;
+    old_alloc_size = other_old_alloc_size = 0;
+    region_init(compress);
+    return;
+  }
+  old_alloc_size = old_space_size;
+  old_start = heap_alloc(old_alloc_size);
+  if (!old_start)
+    failwith("Couldn't allocate the heap\n");
+  old_top = old_start + old_alloc_size / sizeof(word);
+  old_limit = old_start;
+  other_old_start = NULL;
+  other_old_alloc_size = 0;
+}
+
+void rt_set_max_heap(size_t bytes) {
+  // The young generation and both semispaces have to fit
+  if (bytes < YOUNG_BYTES)
+    bytes = YOUNG_BYTES;
+  max_old_space_size = ((bytes - YOUNG_BYTES) / 2) & ~(sizeof(word) - 1);
+}
+
+void rt_set_tenure_age(int minor_gcs) {
+  tenure_age = minor_gcs < 1 ? 1 : minor_gcs;
+}
+
+void rt_set_gc_threads(int threads) {
+  gc_threads = threads < 1 ? 1 : threads;
+}
+
+void rt_set_gc_pause_target(double seconds) {
+  pause_target = seconds;
+}
+
+void rt_set_mark_region(bool enabled) {
+  mark_region = enabled;
+}
+
+void rt_set_compressed(bool enabled) {
+  compress = enabled;
+}
+
+// With no semispaces, the old space can have all of the max heap
+static size_t max_region_bytes(void) {
+  return max_old_space_size > SIZE_MAX / 2 ? SIZE_MAX : 2 * max_old_space_size;
+}
+
+void gc_stats(struct gc_stats *result) {
+  *result = stats;
+  // And what's in the nursery so far
+  result->allocated_bytes += (size_t) (nursery_start
+      + NURSERY_BYTES / sizeof(word)) - (size_t) nursery_top;
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
 
-static obj **data_stack_end;
+static void record_pause(double seconds) {
+  stats.gc_seconds += seconds;
+  size_t us = (size_t) (seconds * 1e6);
+  int bucket = 0;
+  while (us > 1 && bucket < GC_PAUSE_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  stats.pauses[bucket]++;
+}
 
 void gc_init(void) {
   copy_stack = (obj **) malloc(4096);
@@ -36,143 +228,1310 @@ void gc_init(void) {
   remembered_set_size = 0;
   remembered_set_cap = 4096 / sizeof(obj *);
 
-  nursery_start = (word *) malloc(NURSERY_BYTES);
-  nursery_top = nursery_start + NURSERY_BYTES / sizeof(word);
+  nursery_start = heap_alloc(YOUNG_BYTES);
+  reset_nursery();
+  for (int i = 0; i < 2; i++) {
+    survivor_start[i] = nursery_start
+      + (NURSERY_BYTES + i * SURVIVOR_BYTES) / sizeof(word);
+    survivor_ages[i] = malloc(SURVIVOR_BYTES / sizeof(word));
+    if (!survivor_ages[i])
+      failwith("Couldn't allocate the heap\n");
+  }
+  to_survivor = 0;
+  survivor_used = 0;
+
+  init_old_space();
+
+  if (!copy_stack || !remembered_set || !nursery_start)
+    failwith("Couldn't allocate the heap\n");
+  init_stacks();
+}
+
+// Reserve a stack with a guard region below it, and return the start of the
+// reservation
+static uint8_t *map_stack(size_t bytes, size_t guard_bytes) {
+  uint8_t *mem = mmap(NULL, guard_bytes + bytes, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED)
+    failwith("Couldn't allocate the stacks\n");
+  if (mprotect(mem + guard_bytes, bytes, PROT_READ | PROT_WRITE))
+    failwith("Couldn't allocate the stacks\n");
+  return mem;
+}
+
+static void init_stacks(void) {
+  data_stack_mem = map_stack(DATA_STACK_BYTES, DATA_STACK_GUARD_BYTES);
+  data_stack = data_stack_end = clean_start =
+    (obj **) (data_stack_mem + DATA_STACK_GUARD_BYTES + DATA_STACK_BYTES);
+  frame_stack_mem = map_stack(FRAME_STACK_BYTES, FRAME_STACK_GUARD_BYTES);
+  frame_stack_top = frame_stack_mem + FRAME_STACK_GUARD_BYTES + FRAME_STACK_BYTES;
+
+  signal_stack = malloc(SIGNAL_STACK_BYTES);
+  if (!signal_stack)
+    failwith("Couldn't allocate the stacks\n");
+  stack_t ss = { .ss_sp = signal_stack, .ss_size = SIGNAL_STACK_BYTES };
+  if (sigaltstack(&ss, NULL))
+    failwith("Couldn't set up the signal stack\n");
+  budget_catch_stack_faults();
+}
+
+bool gc_stack_overflow(void *addr) {
+  uint8_t *p = addr;
+  return (p >= data_stack_mem && p < data_stack_mem + DATA_STACK_GUARD_BYTES)
+    || (p >= frame_stack_mem && p < frame_stack_mem + FRAME_STACK_GUARD_BYTES);
+}
+
+// Write-protect the data stack from the given address up, rounded up to a
+// page, and unprotect it below that
+static void protect_data_stack(obj **from) {
+  obj **new_start = (obj **) (((size_t) from + 4095) & ~(size_t) 4095);
+  if (new_start < clean_start)
+    mprotect(new_start, (size_t) clean_start - (size_t) new_start, PROT_READ);
+  else if (new_start > clean_start)
+    mprotect(clean_start, (size_t) new_start - (size_t) clean_start,
+        PROT_READ | PROT_WRITE);
+  clean_start = new_start;
+}
+
+bool gc_data_stack_fault(void *addr) {
+  if ((obj **) addr < clean_start || (obj **) addr >= data_stack_end)
+    return false;
+  // Everything below the written page isn't clean anymore either
+  protect_data_stack((obj **) addr + 1);
+  return true;
+}
 
-  old_start = (word *) malloc(2 * NURSERY_BYTES);
-  old_top = old_start + 2 * NURSERY_BYTES / sizeof(word);
+// Give back the pages of a stack from its start up to the given address,
+// rounded down
+static void release_stack(uint8_t *start, uint8_t *below) {
+  uint8_t *end = (uint8_t *) ((size_t) below & ~(size_t) 4095);
+  if (end > start)
+    madvise(start, end - start, MADV_DONTNEED);
+}
+
+void gc_reset(void) {
+  heap_free(other_old_start, other_old_alloc_size);
   other_old_start = NULL;
-  old_space_size = other_old_space_size = 2 * NURSERY_BYTES;
+  other_old_alloc_size = 0;
+
+  // Keep the old space if it's still the starting size
+  size_t start_size = 2 * NURSERY_BYTES;
+  if (start_size > max_old_space_size)
+    start_size = max_old_space_size;
+  if (mark_region) {
+    old_space_size = start_size;
+    region_reset();
+    region_release(start_size);
+  } else if (old_alloc_size == start_size) {
+    old_space_size = start_size;
+    old_top = old_start + old_alloc_size / sizeof(word);
+    old_limit = old_start;
+  } else {
+    heap_free(old_start, old_alloc_size);
+    init_old_space();
+  }
+
+  remembered_set_size = 0;
+  copy_stack_size = 0;
+  c_roots_len = 0;
+  stop_replicating();
+  free_c_roots_len = 0;
+
+  reset_nursery();
+  data_stack = data_stack_end;
+  protect_data_stack(data_stack_end);
+  release_stack(data_stack_mem + DATA_STACK_GUARD_BYTES,
+      (uint8_t *) data_stack_end - STACK_KEEP_BYTES);
+  release_stack(frame_stack_mem + FRAME_STACK_GUARD_BYTES,
+      frame_stack_top - STACK_KEEP_BYTES);
+}
+
+void gc_destroy(void) {
+  if (mark_region)
+    region_destroy();
+  heap_free(old_start, old_alloc_size);
+  heap_free(other_old_start, other_old_alloc_size);
+  heap_free(nursery_start, YOUNG_BYTES);
+  free(survivor_ages[0]);
+  free(survivor_ages[1]);
+  munmap(data_stack_mem, DATA_STACK_GUARD_BYTES + DATA_STACK_BYTES);
+  munmap(frame_stack_mem, FRAME_STACK_GUARD_BYTES + FRAME_STACK_BYTES);
+  data_stack_end = clean_start = NULL;
+  data_stack_mem = frame_stack_mem = frame_stack_top = NULL;
+  stack_t ss = { .ss_flags = SS_DISABLE };
+  sigaltstack(&ss, NULL);
+  free(signal_stack);
+  signal_stack = NULL;
+  free(copy_stack);
+  free(remembered_set);
+  stop_replicating();
+  free(gray);
+  gray = NULL;
+  gray_cap = 0;
+  free(c_roots);
+  free(free_c_roots);
+  c_roots = NULL;
+  free_c_roots = NULL;
+  c_roots_len = c_roots_cap = free_c_roots_len = 0;
+}
 
-  obj **data_stack_start = malloc(DATA_STACK_BYTES);
-  data_stack = data_stack_end = data_stack_start + DATA_STACK_BYTES / sizeof(obj *);
+// Whether a minor GC can promote this many bytes without a major GC first
+static bool old_space_has_room(size_t bytes) {
+  if (mark_region)
+    return region_used() + bytes <= old_space_size;
+  return (size_t) old_top - (size_t) old_limit >= bytes;
 }
 
 void minor_gc(void) {
+  size_t nursery_used = (size_t) (nursery_start + NURSERY_BYTES / sizeof(word))
+    - (size_t) nursery_top;
+  stats.allocated_bytes += nursery_used;
+  budget_gc(nursery_used);
+  double start = now();
+
   // conservative heap check
-  if ((size_t) old_top - (size_t) old_start < NURSERY_BYTES)
-    return major_gc();
+  if (!old_space_has_room(nursery_used + survivor_used)) {
+    // An incremental major GC didn't finish in time
+    if (replicating)
+      stop_replicating();
+    major_gc();
+    record_pause(now() - start);
+    return;
+  }
 
   DEBUG("Minor GC\n");
+  stats.minor_gcs++;
+  word *promoted_end = old_top;
 
-  collect_roots(MINOR);
+  // Incremental major GCs need the survivor spaces empty, so everything gets
+  // promoted while they run
+  bool start_cycle = false;
+  if (pause_target > 0 && !mark_region && !replicating) {
+    word *old_end = old_start + old_alloc_size / sizeof(word);
+    size_t capacity = (size_t) old_end - (size_t) old_limit;
+    start_cycle = (size_t) old_end - (size_t) old_top > capacity / 2;
+  }
+  bool logging = replicating;
+  minor_tenure_age = replicating || start_cycle ? 1 : tenure_age;
+  survivor_top = survivor_start[to_survivor] + SURVIVOR_BYTES / sizeof(word);
+
+  enum gc_type type = mark_region ? REGION_MINOR : MINOR;
+  collect_roots(type, NULL);
 
-  // Collect the remembered set
-  obj **remembered_set_end = remembered_set + remembered_set_size;
-  for (obj **o = remembered_set; o < remembered_set_end; o++) {
-    // old_obj is 'REF ptr' where ptr points to the nursery
-    obj *old_obj = *o;
-    assert(old_obj->entrypoint == rt_ref_entry);
-    old_obj->contents[0] =
-      (word) copy_to_old_space((obj *) old_obj->contents[0], MINOR);
+  // Collect the remembered set: old objects that point to young ones, or
+  // while replicating, all updated old thunks. Keep the ones that still
+  // point to survivors
+  size_t kept = 0;
+  for (size_t i = 0; i < remembered_set_size; i++) {
+    obj *old_obj = remembered_set[i];
+    if (scan_object(old_obj, type))
+      remembered_set[kept++] = old_obj;
   }
-  remembered_set_size = 0;
+  if (!logging)
+    remembered_set_size = kept;
 
-  process_copy_stack(MINOR);
+  process_copy_stack(type);
 
-  nursery_top = nursery_start + NURSERY_BYTES / sizeof(word);
+  reset_nursery();
+  survivor_used = (size_t) (survivor_start[to_survivor]
+      + SURVIVOR_BYTES / sizeof(word)) - (size_t) survivor_top;
+  to_survivor = 1 - to_survivor;
+
+  if (start_cycle) {
+    // It starts from the roots, which reach everything promoted so far
+    start_replicating();
+    promoted_end = old_top;
+  }
+  if (replicating)
+    replicate_slice(start, old_top, promoted_end);
+  if (logging)
+    remembered_set_size = 0;
+  protect_data_stack(dirty_end);
+
+  record_pause(now() - start);
+}
+
+// After a major GC, grow the old space if needed, up to max_size
+static void grow_old_space(size_t used_space, size_t max_size) {
+  if (used_space + MAX_PROMOTED_BYTES > max_size) {
+    // Even the biggest old space wouldn't have room for the next minor GC
+    rt_out_of_memory();
+  }
+  // Incremental major GCs start with the old space half full, and need room
+  // for what gets promoted until they finish
+  size_t wanted = used_space + MAX_PROMOTED_BYTES;
+  if (pause_target > 0)
+    wanted *= 2;
+  if (wanted > old_space_size) {
+    old_space_size *= 2;
+    if (old_space_size > max_size)
+      old_space_size = max_size;
+  }
+
+  if (used_space > stats.max_live_bytes)
+    stats.max_live_bytes = used_space;
+}
+
+static void resize_old_space(void) {
+  word *old_end = old_start + old_alloc_size / sizeof(word);
+  grow_old_space((size_t) old_end - (size_t) old_top, max_old_space_size);
+  if (old_space_size < old_alloc_size)
+    old_limit = old_end - old_space_size / sizeof(word);
+  else
+    old_limit = old_start;
+}
+
+// Keep the from-space for the next major GC, unless it's too small
+static void keep_other_old_space(void) {
+  if (other_old_alloc_size < old_space_size) {
+    heap_free(other_old_start, other_old_alloc_size);
+    other_old_start = NULL;
+    other_old_alloc_size = 0;
+  }
 }
 
 void major_gc(void) {
   DEBUG("Major GC: ");
+  double start = now();
+  // It updates every root, maybe from other threads
+  protect_data_stack(data_stack_end);
 
+  if (mark_region)
+    mark_major();
+  else
+    copy_major();
+
+  // reset the young generation and ignore the remembered set
+  remembered_set_size = 0;
+  reset_nursery();
+  survivor_used = 0;
+  release_stack(data_stack_mem + DATA_STACK_GUARD_BYTES,
+      (uint8_t *) data_stack - STACK_KEEP_BYTES);
+  // It's running on the frame stack, unless C code allocated
+  uint8_t *frame = __builtin_frame_address(0);
+  if (frame > frame_stack_mem && frame < frame_stack_top)
+    release_stack(frame_stack_mem + FRAME_STACK_GUARD_BYTES,
+        frame - STACK_KEEP_BYTES);
+  // Everything is old now
+  protect_data_stack(data_stack);
+
+  double pause = now() - start;
+  stats.major_gcs++;
+  stats.major_seconds += pause;
+  if (pause > stats.max_major_seconds)
+    stats.max_major_seconds = pause;
+}
+
+static void copy_major(void) {
+  // The to-space has to have room for everything in the old space and the
+  // nursery, even if it's bigger than the old space should be. GC threads
+  // waste up to a chunk each
+  word *old_end = old_start + old_alloc_size / sizeof(word);
+  size_t from_used = (size_t) old_end - (size_t) old_top;
+  bool parallel = gc_threads > 1 && from_used >= PARALLEL_GC_MIN_BYTES;
+  size_t needed = from_used + MAX_PROMOTED_BYTES;
+  if (parallel)
+    needed += sizeof(word[gc_threads * GC_CHUNK_WORDS]);
+  size_t to_size = old_space_size;
+  if (to_size < needed)
+    to_size = needed;
+  if (to_size > max_old_space_size)
+    to_size = max_old_space_size;
+  if (other_old_alloc_size < to_size) {
+    heap_free(other_old_start, other_old_alloc_size);
+    other_old_start = NULL;
+  }
+  if (!other_old_start) {
+    other_old_start = heap_alloc(to_size);
+    other_old_alloc_size = to_size;
+  }
   if (!other_old_start)
-    other_old_start = (word *) malloc(other_old_space_size);
+    rt_out_of_memory();
+
+  // Swap the spaces. Keep track of the from-space in case it runs out of
+  // memory part way
   word *from_space = old_start;
-  size_t from_space_size = old_space_size;
+  size_t from_alloc_size = old_alloc_size;
   old_start = other_old_start;
-  old_space_size = other_old_space_size;
-  old_top = old_start + old_space_size / sizeof(word);
-  other_old_start = NULL;
+  old_alloc_size = other_old_alloc_size;
+  old_end = old_start + old_alloc_size / sizeof(word);
+  old_top = old_end;
+  other_old_start = from_space;
+  other_old_alloc_size = from_alloc_size;
 
-  collect_roots(MAJOR);
-  process_copy_stack(MAJOR);
+  if (parallel) {
+    parallel_copy();
+  } else {
+    collect_roots(MAJOR, NULL);
+    process_copy_stack(MAJOR);
+  }
 
-  // set a new size for the old space if needed
-  size_t used_space = (size_t) old_start + old_space_size - (size_t) old_top;
-  if (used_space + NURSERY_BYTES > old_space_size)
-    other_old_space_size *= 2;
+  resize_old_space();
+  keep_other_old_space();
+  DEBUG("copied %zu bytes\n", (size_t) old_end - (size_t) old_top);
+}
 
-  if (from_space_size < other_old_space_size)
-    free(from_space);
-  else
-    other_old_start = from_space;
+// Mark-region major GCs mark old objects where they are, and copy young ones
+// and the ones in blocks being defragmented. The copies can use what's free
+// in the old space, but the old space doesn't grow to make room for them
+static void mark_major(void) {
+  size_t free_space = old_space_size > region_used()
+    ? old_space_size - region_used() : 0;
+  region_start_marking(free_space / 2);
 
-  // reset the nursery and ignore the remembered set
-  remembered_set_size = 0;
-  nursery_top = nursery_start + NURSERY_BYTES / sizeof(word);
+  collect_roots(MARK, NULL);
+  process_mark_stack();
+
+  size_t live = region_sweep();
+  grow_old_space(live, max_region_bytes());
+  region_release(old_space_size);
+  DEBUG("%zu bytes live\n", live);
+}
+
+static obj *par_copy(obj *o, struct gc_thread *t);
 
-  DEBUG("copied %zu bytes\n", used_space);
+// Copy a root, either alone or as GC thread t
+static obj *copy_root(obj *o, enum gc_type type, struct gc_thread *t) {
+  if (t)
+    return par_copy(o, t);
+  return type == MARK ? mark_or_move(o) : evacuate(o, type);
 }
 
-static void collect_roots(enum gc_type type) {
+static void collect_roots(enum gc_type type, struct gc_thread *t) {
   // Collect self
-  self = copy_to_old_space(self, type);
+  self = copy_root(self, type, t);
 
-  // Collect data stack
-  for (obj **root = data_stack; root < data_stack_end; root++)
-    *root = copy_to_old_space(*root, type);
+  // Collect data stack. Minor GCs skip the clean part
+  obj **end = IS_MINOR(type) ? clean_start : data_stack_end;
+  dirty_end = data_stack;
+  for (obj **root = data_stack; root < end; root++) {
+    *root = copy_root(*root, type, t);
+    if (IS_YOUNG(*root))
+      dirty_end = root + 1;
+  }
+
+  // Collect roots from C code
+  for (size_t i = 0; i < c_roots_len; i++) {
+    if (c_roots[i])
+      c_roots[i] = copy_root(c_roots[i], type, t);
+  }
 }
 
-static obj *copy_to_old_space(obj *o, enum gc_type type) {
-  if (type == MINOR && !IS_YOUNG(o))
+// Copy a young object to the to-survivor space, if it's not old enough to
+// promote and there's room. Returns null if it should be promoted
+static obj *copy_to_survivor(obj *o, size_t size) {
+  int from = 1 - to_survivor;
+  unsigned int age = 0;
+  if ((size_t) o - (size_t) survivor_start[from] < SURVIVOR_BYTES)
+    age = survivor_ages[from][(word *) o - survivor_start[from]];
+  if ((int) age + 1 >= minor_tenure_age)
+    return NULL;
+  if ((size_t) (survivor_top - survivor_start[to_survivor]) < size) {
+    stats.premature_bytes += sizeof(word[size]);
+    return NULL;
+  }
+  survivor_top -= size;
+  survivor_ages[to_survivor][survivor_top - survivor_start[to_survivor]] =
+    age + 1;
+  return (obj *) survivor_top;
+}
+
+static void push_copy_stack(obj *o) {
+  if (copy_stack_size == copy_stack_cap) {
+    size_t new_cap = 2 * copy_stack_cap + 1;
+    obj **new_stack = reallocarray(copy_stack, new_cap, sizeof(obj *));
+    if (!new_stack)
+      rt_out_of_memory();
+    copy_stack = new_stack;
+    copy_stack_cap = new_cap;
+  }
+  copy_stack[copy_stack_size++] = o;
+}
+
+// Copy an object out of the from-space: for minor GCs, the nursery or a
+// survivor space, and for copying major GCs, everything
+static obj *evacuate(obj *o, enum gc_type type) {
+  if (IS_MINOR(type) && !IS_YOUNG(o))
+    return o;
+  if (IS_STATIC(o))
+    return o;
+  // Already copied: the remembered set can have the same object twice
+  if (IS_MINOR(type)
+      && (size_t) o - (size_t) survivor_start[to_survivor] < SURVIVOR_BYTES)
     return o;
 
   if (o->entrypoint == rt_forward_entry) {
     return (obj *) o->contents[0];
   } else if (o->entrypoint == rt_ref_entry) {
-    // Compress REF indirections
-    obj *new = copy_to_old_space((obj *) o->contents[0], type);
+    // Compress REF indirections. Forward the REF too, so that other
+    // pointers to it don't copy the to-space object again
+    obj *new = evacuate((obj *) o->contents[0], type);
+    o->entrypoint = rt_forward_entry;
     o->contents[0] = (word) new;
     return new;
   } else {
     size_t size = GC_DATA(o)->size;
-    if (!size) size = INFO_WORD(o)->size;
-    obj *new = (obj *) (old_top -= size);
+    if (!size) size = info_word(o).size;
+    obj *new = NULL;
+    if (IS_MINOR(type) && minor_tenure_age > 1)
+      new = copy_to_survivor(o, size);
+    if (!new) {
+      if (type == REGION_MINOR) {
+        new = (obj *) region_alloc(size, true);
+        if (!new)
+          rt_out_of_memory();
+      } else {
+        if ((size_t) (old_top - old_start) < size)
+          rt_out_of_memory();
+        new = (obj *) (old_top -= size);
+      }
+      if (IS_MINOR(type))
+        stats.promoted_bytes += sizeof(word[size]);
+    }
     memcpy(new, o, sizeof(word[size]));
 
     // set up forwarding
     o->entrypoint = rt_forward_entry;
     o->contents[0] = (word) new;
 
-    // add to the copy stack
-    if (copy_stack_size == copy_stack_cap) {
-      size_t new_cap = 2 * copy_stack_cap + 1;
-      copy_stack = reallocarray(copy_stack, new_cap, sizeof(obj *));
-      copy_stack_cap = new_cap;
+    push_copy_stack(new);
+    return new;
+  }
+}
+
+// Evacuate the fields of an object. Returns whether any of them are still
+// young afterwards
+static bool scan_object(obj *o, enum gc_type type) {
+  word *start;
+  size_t size = GC_DATA(o)->size;
+  if (GC_DATA(o)->tag & COMPRESSED) {
+    bool young = false;
+    for (size_t i = 0; i < 2 * (size - 1); i++) {
+      obj *field = evacuate(half_field(o, i), type);
+      set_half_field(o, i, field);
+      young |= IS_YOUNG(field);
     }
-    copy_stack[copy_stack_size++] = new;
+    return young;
+  }
+  if (size) {
+    // Contains size - 1 many GC pointers
+    start = &o->contents[0];
+  } else {
+    // Contains size - 2 many GC pointers
+    size = info_word(o).size;
+    start = &o->contents[1];
+  }
+  word *end = &o->contents[size - 1];
+  bool young = false;
+  for (word *ptr = start; ptr < end; ptr++) {
+    *ptr = (word) evacuate((obj *) *ptr, type);
+    young |= IS_YOUNG(*ptr);
+  }
+  return young;
+}
+
+static void process_copy_stack(enum gc_type type) {
+  while (copy_stack_size > 0) {
+    obj *o = copy_stack[--copy_stack_size];
+    // Promoted objects that point to survivors have to be remembered
+    if (scan_object(o, type) && IS_MINOR(type) && !IS_YOUNG(o))
+      write_barrier(o);
+  }
+}
+
+// For mark-region major GCs: mark an old object where it is, or move it if
+// it's young or in a block being defragmented. Either way, its fields still
+// need marking
+static obj *mark_or_move(obj *o) {
+  if (IS_STATIC(o))
+    return o;
 
+  if (o->entrypoint == rt_forward_entry)
+    return (obj *) o->contents[0];
+  if (o->entrypoint == rt_ref_entry) {
+    // Compress REF indirections, like evacuate
+    obj *new = mark_or_move((obj *) o->contents[0]);
+    o->entrypoint = rt_forward_entry;
+    o->contents[0] = (word) new;
     return new;
   }
+
+  size_t size = GC_DATA(o)->size;
+  if (!size) size = info_word(o).size;
+  bool young = IS_YOUNG(o);
+  // Something being defragmented that's marked already got left in place,
+  // since there was no room to move it, and other pointers to it stayed the
+  // same
+  obj *new = NULL;
+  if (young || (region_evacuating(o) && !region_marked(o))) {
+    new = (obj *) region_alloc(size, young);
+    if (!new && young)
+      rt_out_of_memory();
+  }
+  if (!new) {
+    if (region_mark(o, size))
+      push_copy_stack(o);
+    return o;
+  }
+
+  region_mark(new, size);
+  memcpy(new, o, sizeof(word[size]));
+  o->entrypoint = rt_forward_entry;
+  o->contents[0] = (word) new;
+  push_copy_stack(new);
+  return new;
 }
 
-static void process_copy_stack(enum gc_type type) {
+static void process_mark_stack(void) {
   while (copy_stack_size > 0) {
     obj *o = copy_stack[--copy_stack_size];
     word *start;
     size_t size = GC_DATA(o)->size;
+    if (GC_DATA(o)->tag & COMPRESSED) {
+      for (size_t i = 0; i < 2 * (size - 1); i++)
+        set_half_field(o, i, mark_or_move(half_field(o, i)));
+      continue;
+    }
     if (size) {
-      // Contains size - 1 many GC pointers
       start = &o->contents[0];
     } else {
-      // Contains size - 2 many GC pointers
-      size = INFO_WORD(o)->size;
+      size = info_word(o).size;
       start = &o->contents[1];
     }
     word *end = &o->contents[size - 1];
     for (word *ptr = start; ptr < end; ptr++)
-      *ptr = (word) copy_to_old_space((obj *) *ptr, type);
+      *ptr = (word) mark_or_move((obj *) *ptr);
+  }
+}
+
+/************** Incremental major GC **************/
+
+// With a pause target, major GCs replicate the old space into the to-space a
+// slice at a time, at the end of minor GCs. The mutator keeps using the
+// from-space until the flip, so objects can't be forwarded in place. Instead,
+// replica_of maps each word of the from-space to the replica of the object
+// there.
+//
+// The only changes to old objects are thunk updates. While replicating, the
+// write barrier logs all of them in the remembered set, and each slice does
+// them to the replicas too. Objects promoted in the meantime get replicated
+// as well.
+
+__thread bool replicating = false;
+static __thread word *to_start;
+static __thread word *to_top;
+static __thread size_t to_alloc_size;
+// Offsets in words back from the end of the to-space, or 0 if the object
+// isn't replicated yet
+static __thread uint32_t *replica_of;
+
+#define TO_END (to_start + to_alloc_size / sizeof(word))
+#define IN_TO_SPACE(o) ((size_t) (o) - (size_t) to_start < to_alloc_size)
+
+static obj *replicate(obj *o) {
+  // Redone updates already point to replicas
+  if (IN_TO_SPACE(o) || IS_STATIC(o))
+    return o;
+  size_t i = (word *) o - old_start;
+  assert(i < old_alloc_size / sizeof(word));
+  if (replica_of[i])
+    return (obj *) (TO_END - replica_of[i]);
+
+  obj *r;
+  if (o->entrypoint == rt_ref_entry) {
+    // Compress REF indirections
+    r = replicate((obj *) o->contents[0]);
+  } else {
+    size_t size = GC_DATA(o)->size;
+    if (!size) size = info_word(o).size;
+    if ((size_t) (to_top - to_start) < size)
+      rt_out_of_memory();
+    r = (obj *) (to_top -= size);
+    memcpy(r, o, sizeof(word[size]));
+
+    if (gray_len == gray_cap) {
+      size_t new_cap = 2 * gray_cap + 1024;
+      obj **new_gray = reallocarray(gray, new_cap, sizeof(obj *));
+      if (!new_gray)
+        rt_out_of_memory();
+      gray = new_gray;
+      gray_cap = new_cap;
+    }
+    gray[gray_len++] = r;
+  }
+  replica_of[i] = TO_END - (word *) r;
+  return r;
+}
+
+static void scan_replica(obj *r) {
+  word *start;
+  size_t size = GC_DATA(r)->size;
+  if (GC_DATA(r)->tag & COMPRESSED) {
+    for (size_t i = 0; i < 2 * (size - 1); i++)
+      set_half_field(r, i, replicate(half_field(r, i)));
+    return;
+  }
+  if (size) {
+    start = &r->contents[0];
+  } else {
+    size = info_word(r).size;
+    start = &r->contents[1];
+  }
+  word *end = &r->contents[size - 1];
+  for (word *ptr = start; ptr < end; ptr++)
+    *ptr = (word) replicate((obj *) *ptr);
+}
+
+static void start_replicating(void) {
+  // The replicas fit in a space as big as the from-space. It's also a chance
+  // to grow
+  size_t to_size = old_alloc_size;
+  if (to_size < old_space_size)
+    to_size = old_space_size;
+  if (to_size / sizeof(word) > UINT32_MAX)
+    return;
+  if (other_old_alloc_size < to_size) {
+    heap_free(other_old_start, other_old_alloc_size);
+    other_old_start = heap_alloc(to_size);
+    other_old_alloc_size = other_old_start ? to_size : 0;
+  }
+  replica_of = calloc(old_alloc_size / sizeof(word), sizeof(uint32_t));
+  // Without the memory, it waits for a stop-the-world major GC
+  if (!other_old_start || !replica_of) {
+    free(replica_of);
+    replica_of = NULL;
+    return;
+  }
+  to_start = other_old_start;
+  to_alloc_size = other_old_alloc_size;
+  to_top = TO_END;
+  gray_len = 0;
+  replicating = true;
+
+  // Start from the roots, but leave them alone until the flip
+  replicate(self);
+  for (obj **root = data_stack; root < data_stack_end; root++)
+    replicate(*root);
+  for (size_t i = 0; i < c_roots_len; i++) {
+    if (c_roots[i])
+      replicate(c_roots[i]);
+  }
+}
+
+static void stop_replicating(void) {
+  free(replica_of);
+  replica_of = NULL;
+  gray_len = 0;
+  replicating = false;
+}
+
+// Do the updates logged in the remembered set to the replicas
+static void replicate_updates(void) {
+  for (size_t i = 0; i < remembered_set_size; i++) {
+    obj *thunk = remembered_set[i];
+    uint32_t offset = replica_of[(word *) thunk - old_start];
+    // If it's not replicated yet, it will be as it is now
+    if (!offset)
+      continue;
+    obj *r = (obj *) (TO_END - offset);
+    r->entrypoint = rt_ref_entry;
+    r->contents[0] = (word) replicate((obj *) thunk->contents[0]);
+  }
+}
+
+static obj *flip_root(obj *o) {
+  obj *r = replicate(o);
+  // Thunks being evaluated have update frames on the data stack. Their
+  // replicas have to be black holes too
+  if (o->entrypoint == rt_blackhole_entry
+      && r->entrypoint != rt_blackhole_entry) {
+    r->entrypoint = rt_blackhole_entry;
+    set_info_word(r, (struct info_word) { .size = 2, .var = 0 });
+  }
+  return r;
+}
+
+// Switch the mutator over to the replicas, and make the to-space the old space
+static void flip(void) {
+  protect_data_stack(data_stack_end);
+  self = flip_root(self);
+  for (obj **root = data_stack; root < data_stack_end; root++)
+    *root = flip_root(*root);
+  for (size_t i = 0; i < c_roots_len; i++) {
+    if (c_roots[i])
+      c_roots[i] = flip_root(c_roots[i]);
+  }
+  while (gray_len)
+    scan_replica(gray[--gray_len]);
+
+  other_old_start = old_start;
+  other_old_alloc_size = old_alloc_size;
+  old_start = to_start;
+  old_alloc_size = to_alloc_size;
+  old_top = to_top;
+  stop_replicating();
+
+  resize_old_space();
+  keep_other_old_space();
+  stats.incremental_gcs++;
+  DEBUG("Flipped\n");
+}
+
+// Do a slice of replicating, flipping if it's done. The slice lasts until the
+// pause target, but does enough to finish before the old space runs out, if
+// the minor GCs keep promoting as much as this one
+static void replicate_slice(double start, word *promoted, word *promoted_end) {
+  replicate_updates();
+
+  // The objects promoted by this minor GC are contiguous, and haven't
+  // changed yet
+  for (word *p = promoted; p < promoted_end;) {
+    obj *o = (obj *) p;
+    size_t size = GC_DATA(o)->size;
+    if (!size) size = info_word(o).size;
+    replicate(o);
+    p += size;
+  }
+
+  // Everything in the from-space that isn't replicated yet is an upper bound
+  // on what's left
+  size_t from_used = (size_t) (old_start + old_alloc_size / sizeof(word))
+    - (size_t) old_top;
+  size_t to_used = (size_t) TO_END - (size_t) to_top;
+  size_t left = from_used > to_used ? from_used - to_used : 0;
+  size_t per_gc = (size_t) promoted_end - (size_t) promoted;
+  if (per_gc < NURSERY_BYTES / 16)
+    per_gc = NURSERY_BYTES / 16;
+  size_t room = (size_t) old_top - (size_t) old_limit;
+  size_t slices_left = room > MAX_PROMOTED_BYTES
+    ? (room - MAX_PROMOTED_BYTES) / per_gc : 0;
+  size_t min_work = slices_left ? left / slices_left : SIZE_MAX;
+
+  word *work_start = to_top;
+  for (unsigned int n = 1; gray_len; n++) {
+    scan_replica(gray[--gray_len]);
+    if (n % 64 == 0
+        && (size_t) work_start - (size_t) to_top >= min_work
+        && now() - start >= pause_target)
+      return;
+  }
+  flip();
+}
+
+/************** Parallel major GC **************/
+
+// A GC thread's work that other GC threads can steal: to-space objects that
+// still need scanning. The owner takes from the tail, and thieves from the
+// head
+struct deque {
+  pthread_mutex_t lock;
+  obj **items;
+  size_t head, tail, cap;
+  // tail - head, for checking without the lock
+  _Atomic size_t len;
+};
+
+struct par_gc {
+  // Where the static objects are, for IS_STATIC in the helper threads
+  uint8_t *code_start, *code_end;
+  word *to_start;
+  _Atomic(word *) to_top;
+  struct gc_thread *threads;
+  int n_threads;
+  // How many threads could still make more work
+  _Atomic int busy;
+  // Out of memory
+  _Atomic bool failed;
+};
+
+struct gc_thread {
+  struct par_gc *gc;
+  // It copies objects into its own chunk of the to-space, downwards from
+  // chunk_top to chunk_start
+  word *chunk_start, *chunk_top;
+  // Work that's only for this thread
+  obj **local;
+  size_t local_len, local_cap;
+  struct deque shared;
+};
+
+// The entrypoint of an object that some GC thread is copying
+static void busy_entry(void) {}
+
+static word *par_alloc(struct gc_thread *t, size_t size) {
+  if ((size_t) (t->chunk_top - t->chunk_start) < size) {
+    struct par_gc *gc = t->gc;
+    word *top = atomic_load(&gc->to_top);
+    size_t chunk;
+    do {
+      size_t left = top - gc->to_start;
+      if (left < size)
+        return NULL;
+      chunk = left < GC_CHUNK_WORDS ? left : GC_CHUNK_WORDS;
+      if (chunk < size)
+        chunk = size;
+    } while (!atomic_compare_exchange_weak(&gc->to_top, &top, top - chunk));
+    // The rest of the old chunk is wasted
+    t->chunk_top = top;
+    t->chunk_start = top - chunk;
+  }
+  return t->chunk_top -= size;
+}
+
+// Move the older half of the local work to the shared deque
+static void share(struct gc_thread *t) {
+  struct deque *d = &t->shared;
+  size_t n = t->local_len / 2;
+  pthread_mutex_lock(&d->lock);
+  if (d->tail + n > d->cap) {
+    memmove(d->items, d->items + d->head, sizeof(obj *[d->tail - d->head]));
+    d->tail -= d->head;
+    d->head = 0;
+  }
+  if (d->tail + n > d->cap) {
+    size_t new_cap = 2 * (d->tail + n);
+    obj **new_items = reallocarray(d->items, new_cap, sizeof(obj *));
+    if (!new_items) {
+      pthread_mutex_unlock(&d->lock);
+      return;
+    }
+    d->items = new_items;
+    d->cap = new_cap;
+  }
+  memcpy(d->items + d->tail, t->local, sizeof(obj *[n]));
+  d->tail += n;
+  atomic_store(&d->len, d->tail - d->head);
+  pthread_mutex_unlock(&d->lock);
+
+  t->local_len -= n;
+  memmove(t->local, t->local + n, sizeof(obj *[t->local_len]));
+}
+
+static void push(struct gc_thread *t, obj *o) {
+  if (t->local_len == t->local_cap) {
+    size_t new_cap = 2 * t->local_cap;
+    obj **new_local = reallocarray(t->local, new_cap, sizeof(obj *));
+    if (!new_local) {
+      atomic_store(&t->gc->failed, true);
+      return;
+    }
+    t->local = new_local;
+    t->local_cap = new_cap;
+  }
+  t->local[t->local_len++] = o;
+  // Keep some work where the other threads can get it
+  if (t->local_len >= 64 && atomic_load_explicit(&t->shared.len,
+        memory_order_relaxed) == 0)
+    share(t);
+}
+
+// Take some of the work from another thread's deque, or from its own
+static bool steal_from(struct gc_thread *t, struct deque *d, bool own) {
+  if (atomic_load_explicit(&d->len, memory_order_relaxed) == 0)
+    return false;
+  pthread_mutex_lock(&d->lock);
+  size_t len = d->tail - d->head;
+  size_t n = own ? len : (len + 1) / 2;
+  if (n > t->local_cap - t->local_len)
+    n = t->local_cap - t->local_len;
+  memcpy(t->local + t->local_len, d->items + d->head, sizeof(obj *[n]));
+  t->local_len += n;
+  d->head += n;
+  if (d->head == d->tail)
+    d->head = d->tail = 0;
+  atomic_store(&d->len, d->tail - d->head);
+  pthread_mutex_unlock(&d->lock);
+  return n > 0;
+}
+
+static bool steal(struct gc_thread *t) {
+  struct par_gc *gc = t->gc;
+  if (steal_from(t, &t->shared, true))
+    return true;
+  int self_index = t - gc->threads;
+  for (int i = 1; i < gc->n_threads; i++) {
+    if (steal_from(t, &gc->threads[(self_index + i) % gc->n_threads].shared,
+          false))
+      return true;
+  }
+  return false;
+}
+
+static bool any_work(struct par_gc *gc) {
+  for (int i = 0; i < gc->n_threads; i++) {
+    if (atomic_load_explicit(&gc->threads[i].shared.len, memory_order_relaxed))
+      return true;
   }
+  return false;
+}
+
+// Like evacuate, but any number of GC threads can copy at once. The
+// first to install busy_entry in an object copies it, and the rest wait for
+// the forwarding pointer
+static obj *par_copy(obj *o, struct gc_thread *t) {
+  if (IS_STATIC(o))
+    return o;
+  _Atomic(void (*)(void)) *entry_ptr = (void *) &o->entrypoint;
+  void (*entry)(void) = atomic_load_explicit(entry_ptr, memory_order_acquire);
+  for (;;) {
+    if (entry == rt_forward_entry)
+      return (obj *) o->contents[0];
+    if (entry == busy_entry) {
+      sched_yield();
+      entry = atomic_load_explicit(entry_ptr, memory_order_acquire);
+      continue;
+    }
+    if (atomic_compare_exchange_weak_explicit(entry_ptr, &entry, busy_entry,
+          memory_order_acquire, memory_order_acquire))
+      break;
+  }
+
+  obj *new;
+  if (entry == rt_ref_entry) {
+    // Compress REF indirections
+    new = par_copy((obj *) o->contents[0], t);
+  } else {
+    size_t size = ((struct gc_data *) ((size_t) entry
+          - sizeof(struct gc_data)))->size;
+    if (!size) size = info_word(o).size;
+    new = (obj *) par_alloc(t, size);
+    if (!new) {
+      atomic_store(&t->gc->failed, true);
+      atomic_store_explicit(entry_ptr, entry, memory_order_release);
+      return o;
+    }
+    new->entrypoint = entry;
+    memcpy(new->contents, o->contents, sizeof(word[size - 1]));
+    push(t, new);
+  }
+
+  o->contents[0] = (word) new;
+  atomic_store_explicit(entry_ptr, rt_forward_entry, memory_order_release);
+  return new;
+}
+
+static void par_scan(struct gc_thread *t, obj *o) {
+  word *start;
+  size_t size = GC_DATA(o)->size;
+  if (GC_DATA(o)->tag & COMPRESSED) {
+    for (size_t i = 0; i < 2 * (size - 1); i++)
+      set_half_field(o, i, par_copy(half_field(o, i), t));
+    return;
+  }
+  if (size) {
+    start = &o->contents[0];
+  } else {
+    size = info_word(o).size;
+    start = &o->contents[1];
+  }
+  word *end = &o->contents[size - 1];
+  for (word *ptr = start; ptr < end; ptr++)
+    *ptr = (word) par_copy((obj *) *ptr, t);
+}
+
+// Scan objects until there's no work left in any thread
+static void par_drain(struct gc_thread *t) {
+  struct par_gc *gc = t->gc;
+  for (;;) {
+    while (t->local_len && !atomic_load_explicit(&gc->failed,
+          memory_order_relaxed))
+      par_scan(t, t->local[--t->local_len]);
+    if (atomic_load(&gc->failed))
+      return;
+    if (steal(t))
+      continue;
+
+    // Idle. Work can only show up again while some thread is busy
+    atomic_fetch_sub(&gc->busy, 1);
+    for (;;) {
+      if (atomic_load(&gc->failed))
+        return;
+      if (any_work(gc)) {
+        atomic_fetch_add(&gc->busy, 1);
+        break;
+      }
+      if (atomic_load(&gc->busy) == 0)
+        return;
+      sched_yield();
+    }
+  }
+}
+
+static void *gc_helper(void *arg) {
+  struct gc_thread *t = arg;
+  rt_code_start = t->gc->code_start;
+  rt_code_end = t->gc->code_end;
+  par_drain(t);
+  return NULL;
+}
+
+// Copy everything reachable into the to-space, using gc_threads threads.
+// This thread collects the roots
+static void parallel_copy(void) {
+  int n = gc_threads;
+  struct par_gc gc = {
+    .code_start = rt_code_start,
+    .code_end = rt_code_end,
+    .to_start = old_start,
+    .to_top = old_top,
+    .n_threads = n,
+    .busy = n,
+    .failed = false,
+  };
+  gc.threads = calloc(n, sizeof(struct gc_thread));
+  pthread_t *helpers = malloc(sizeof(pthread_t[n]));
+  if (!gc.threads || !helpers)
+    rt_out_of_memory();
+  for (int i = 0; i < n; i++) {
+    struct gc_thread *t = &gc.threads[i];
+    t->gc = &gc;
+    t->chunk_start = t->chunk_top = old_top;
+    t->local_cap = 1024;
+    t->local = malloc(sizeof(obj *[t->local_cap]));
+    if (!t->local)
+      atomic_store(&gc.failed, true);
+    pthread_mutex_init(&t->shared.lock, NULL);
+  }
+
+  int n_helpers = 0;
+  for (int i = 1; i < n; i++) {
+    if (pthread_create(&helpers[n_helpers], NULL, gc_helper, &gc.threads[i]))
+      atomic_fetch_sub(&gc.busy, 1);
+    else
+      n_helpers++;
+  }
+
+  if (!atomic_load(&gc.failed)) {
+    collect_roots(MAJOR, &gc.threads[0]);
+    par_drain(&gc.threads[0]);
+  } else {
+    atomic_fetch_sub(&gc.busy, 1);
+  }
+  for (int i = 0; i < n_helpers; i++)
+    pthread_join(helpers[i], NULL);
+
+  old_top = atomic_load(&gc.to_top);
+  for (int i = 0; i < n; i++) {
+    free(gc.threads[i].local);
+    free(gc.threads[i].shared.items);
+    pthread_mutex_destroy(&gc.threads[i].shared.lock);
+  }
+  free(gc.threads);
+  free(helpers);
+  if (atomic_load(&gc.failed))
+    rt_out_of_memory();
 }
 
 // Write barrier: push thunk to the remembered set
 void write_barrier(obj *thunk) {
   if (remembered_set_size == remembered_set_cap) {
     size_t new_cap = remembered_set_size * 2;
-    remembered_set = reallocarray(remembered_set, new_cap, sizeof(obj *));
+    obj **new_set = reallocarray(remembered_set, new_cap, sizeof(obj *));
+    if (!new_set)
+      rt_out_of_memory();
+    remembered_set = new_set;
     remembered_set_cap = new_cap;
   }
   remembered_set[remembered_set_size++] = thunk;
 }
 
+size_t gc_add_root(obj *o) {
+  size_t root;
+  if (free_c_roots_len) {
+    root = free_c_roots[--free_c_roots_len];
+  } else {
+    if (c_roots_len == c_roots_cap) {
+      size_t new_cap = 2 * c_roots_cap + 16;
+      obj **new_roots = reallocarray(c_roots, new_cap, sizeof(obj *));
+      if (new_roots)
+        c_roots = new_roots;
+      size_t *new_free = reallocarray(free_c_roots, new_cap, sizeof(size_t));
+      if (new_free)
+        free_c_roots = new_free;
+      if (!new_roots || !new_free)
+        rt_out_of_memory();
+      c_roots_cap = new_cap;
+    }
+    root = c_roots_len++;
+  }
+  c_roots[root] = o;
+  return root;
+}
+
+obj *gc_get_root(size_t root) {
+  assert(root < c_roots_len && c_roots[root]);
+  return c_roots[root];
+}
+
+void gc_remove_root(size_t root) {
+  assert(root < c_roots_len && c_roots[root]);
+  c_roots[root] = NULL;
+  free_c_roots[free_c_roots_len++] = root;
+}
+
+/************** Moving terms between threads **************/
+
+// A copy of everything reachable from an object, out of any heap. Fields that
+// point into the copy are (offset << 1) | 1, in words, and fields that point
+// to static objects stay the same. Objects are in the order they were copied
+struct gc_graph {
+  word root;
+  size_t len, cap;
+  word words[];
+};
+
+struct exported {
+  obj *o;
+  word entrypoint, first;
+};
+
+static word export_obj(obj *o, struct gc_graph **g,
+    struct exported **exported, size_t *n_exported) {
+  while (o->entrypoint == rt_ref_entry)
+    o = (obj *) o->contents[0];
+  if (IS_STATIC(o))
+    return (word) o;
+  // Already exported: forwarded, like in a GC, until export is done
+  if (o->entrypoint == rt_forward_entry)
+    return o->contents[0];
+
+  size_t size = GC_DATA(o)->size;
+  if (!size) size = info_word(o).size;
+  if ((*g)->len + size > (*g)->cap) {
+    (*g)->cap = 2 * ((*g)->len + size);
+    *g = realloc(*g, sizeof(struct gc_graph) + sizeof(word[(*g)->cap]));
+    if (!*g)
+      failwith("Couldn't allocate a copy of a term\n");
+  }
+  word offset = (*g)->len;
+  memcpy(&(*g)->words[offset], o, sizeof(word[size]));
+  (*g)->len += size;
+
+  if (*n_exported % 64 == 0) {
+    *exported = reallocarray(*exported, *n_exported + 64,
+        sizeof(struct exported));
+    if (!*exported)
+      failwith("Couldn't allocate a copy of a term\n");
+  }
+  (*exported)[(*n_exported)++] = (struct exported) {
+    o, (word) o->entrypoint, o->contents[0]
+  };
+  o->entrypoint = rt_forward_entry;
+  o->contents[0] = offset << 1 | 1;
+  return offset << 1 | 1;
+}
+
+struct gc_graph *gc_export(obj *o) {
+  struct gc_graph *g = malloc(sizeof(struct gc_graph) + sizeof(word[64]));
+  if (!g)
+    failwith("Couldn't allocate a copy of a term\n");
+  *g = (struct gc_graph) { .len = 0, .cap = 64 };
+  struct exported *exported = NULL;
+  size_t n_exported = 0;
+
+  g->root = export_obj(o, &g, &exported, &n_exported);
+  // Breadth first, like a Cheney scan over the copy
+  for (size_t scan = 0; scan < g->len;) {
+    obj *copy = (obj *) &g->words[scan];
+    size_t size = GC_DATA(copy)->size;
+    if (GC_DATA(copy)->tag & COMPRESSED) {
+      // Offsets into the copy fit in 32 bits as long as the heap does
+      for (size_t i = 0; i < 2 * (size - 1); i++) {
+        word field = export_obj(half_field(copy, i), &g, &exported,
+            &n_exported);
+        copy = (obj *) &g->words[scan];
+        set_half_field(copy, i, (obj *) field);
+      }
+      scan += size;
+      continue;
+    }
+    size_t first = 0;
+    if (!size) {
+      size = info_word(copy).size;
+      first = 1;
+    }
+    for (size_t i = first; i < size - 1; i++) {
+      word field = export_obj((obj *) g->words[scan + 1 + i], &g, &exported,
+          &n_exported);
+      g->words[scan + 1 + i] = field;
+    }
+    scan += size;
+  }
+
+  // Put the originals back
+  for (size_t i = 0; i < n_exported; i++) {
+    exported[i].o->entrypoint = (void (*)(void)) exported[i].entrypoint;
+    exported[i].o->contents[0] = exported[i].first;
+  }
+  free(exported);
+  return g;
+}
+
+// Allocate an imported object straight in the old space
+static word *import_alloc(size_t size) {
+  if (mark_region) {
+    word *ptr = region_alloc(size, true);
+    if (!ptr)
+      rt_out_of_memory();
+    return ptr;
+  }
+  if ((size_t) (old_top - old_start) < size)
+    rt_out_of_memory();
+  return old_top -= size;
+}
+
+// Once the objects are copied, where a field of the graph points to
+static word imported(struct gc_graph *g, word field) {
+  return field & 1 ? g->words[field >> 1] : field;
+}
+
+obj *gc_import(struct gc_graph *g) {
+  // Make sure it fits in the semispace. The next major GC sizes it properly
+  size_t bytes = sizeof(word[g->len]);
+  if (!mark_region && (size_t) old_top - (size_t) old_start < bytes) {
+    if (bytes > max_old_space_size)
+      rt_out_of_memory();
+    size_t alloc_size = 2 * bytes < max_old_space_size
+      ? 2 * bytes : max_old_space_size;
+    word *new_start = heap_alloc(alloc_size);
+    if (!new_start)
+      rt_out_of_memory();
+    heap_free(old_start, old_alloc_size);
+    old_start = old_limit = new_start;
+    old_alloc_size = old_space_size = alloc_size;
+    old_top = old_start + old_alloc_size / sizeof(word);
+  }
+
+  // Copy the objects, leaving where each one went in place of its
+  // entrypoint in the graph
+  for (size_t offset = 0; offset < g->len;) {
+    obj *copy = (obj *) &g->words[offset];
+    size_t size = GC_DATA(copy)->size;
+    if (!size) size = info_word(copy).size;
+    word *new = import_alloc(size);
+    memcpy(new, copy, sizeof(word[size]));
+    g->words[offset] = (word) new;
+    offset += size;
+  }
+
+  // Then point their fields at each other
+  for (size_t offset = 0; offset < g->len;) {
+    obj *new = (obj *) g->words[offset];
+    size_t size = GC_DATA(new)->size;
+    if (GC_DATA(new)->tag & COMPRESSED) {
+      for (size_t i = 0; i < 2 * (size - 1); i++)
+        set_half_field(new, i, (obj *) imported(g, (word) half_field(new, i)));
+      offset += size;
+      continue;
+    }
+    word *start = &new->contents[0];
+    if (!size) {
+      size = info_word(new).size;
+      start = &new->contents[1];
+    }
+    for (word *ptr = start; ptr < &new->contents[size - 1]; ptr++)
+      *ptr = imported(g, *ptr);
+    offset += size;
+  }
+  return (obj *) imported(g, g->root);
+}
@@ -1,16 +1,46 @@
 #include "runtime.h"
 
 void gc_init(void);
+// Throw away the whole heap, after abandoning an evaluation part way
+void gc_reset(void);
+// Free the whole heap
+void gc_destroy(void);
 
 void minor_gc(void);
+// For rt_gc_stats, which has to be in the runtime to see the nursery
+struct gc_stats;
+void gc_stats(struct gc_stats *stats);
 void write_barrier(obj *thunk);
+// For the SIGSEGV handler: if it's a write to the clean part of the data
+// stack, unprotect it and return true
+bool gc_data_stack_fault(void *addr);
+// Whether it's in the guard region below either stack
+bool gc_stack_overflow(void *addr);
+
+// During an incremental major GC, the write barrier logs every update to an old
+// thunk, not just the ones that point to the nursery
+extern __thread bool replicating;
+
+// Roots held by C code, such as handles to terms. The GC keeps them alive and
+// up to date
+size_t gc_add_root(obj *o);
+obj *gc_get_root(size_t root);
+void gc_remove_root(size_t root);
+
+// Copy everything reachable from an object out of this thread's heap, into a
+// malloc'd graph that another thread can import. The heap stays the same
+struct gc_graph;
+struct gc_graph *gc_export(obj *o);
+// Copy a graph into the old space, which has to be empty, and return its
+// root. This overwrites the graph
+obj *gc_import(struct gc_graph *g);
 
 // This is only called from C code; generated code has this inlined
 static inline obj *alloc(void (*entrypoint)(void), size_t size) {
   // TODO: have a max term size somewhere
   assert(sizeof(word[size]) < 10240);
   word *ptr = nursery_top - size;
-  if (ptr < nursery_start) {
+  if (ptr < heap_limit) {
     minor_gc();
     ptr = nursery_top - size;
   }
@@ -1,55 +1,225 @@
 #include "gc.h"
 #include "builtins.h"
 #include "normalize.h"
+#include "budget.h"
 
-static unsigned int *buf;
-static size_t buf_len;
-static size_t buf_cap;
+#include <unistd.h>
+#include <errno.h>
+
+static __thread unsigned int *buf;
+static __thread size_t buf_len;
+static __thread size_t buf_cap;
+
+// A run of items on the data stack at the same level
+struct level_run {
+  unsigned int level;
+  unsigned int count;
+};
+// The runs for quote. They're kept across calls, so that nothing leaks when
+// eval leaves through budget_exit
+static __thread struct level_run *quote_runs;
+static __thread size_t quote_runs_cap;
 
 static void push_buf(unsigned int x) {
   if (buf_len == buf_cap) {
+    unsigned int *new_buf = reallocarray(buf, 2 * buf_cap, sizeof(unsigned int));
+    if (!new_buf)
+      rt_out_of_memory();
+    buf = new_buf;
     buf_cap *= 2;
-    buf = reallocarray(buf, buf_cap, sizeof(unsigned int));
   }
   buf[buf_len++] = x;
 }
 
-// Pop an object from the data stack and write its normal form to the buffer
-static void quote(void);
+// Write the normal form of 'self' to the buffer, with variables numbered by
+// level, starting from the given level
+static void quote(unsigned int level);
+// Renumber the variables in a normal form from levels to the order of their
+// binders
+static bool number_vars(unsigned int *nf);
 
 // Apply 'self' to an argument, returning the value in 'self'
 static void apply(obj *arg);
 // Evaluate 'self', returning the value in 'self'
 static void eval(void);
 
+// The number of arguments of a rigid term
+static unsigned int rigid_argc(obj *r);
+// Copy the arguments of a rigid term to args[0], args[stride], etc.
+static void rigid_args(obj *r, unsigned int argc, obj **args, size_t stride);
+
 struct saved_regs {
   obj *self;
   obj **data_stack;
   word *nursery_top;
-  word *nursery_start;
+  word *heap_limit;
   size_t argc;
 };
 
 static struct saved_regs save_regs(void);
 static void restore_regs(struct saved_regs);
 
+// The printer's buffers
+static __thread char *out_buf;
+static __thread unsigned int *var_levels;
+static __thread size_t var_levels_cap;
+
+// The runtime's registers, saved while it's not running. The heap persists
+// between calls into the runtime, so that handles stay valid
+static __thread struct saved_regs runtime_regs;
+static __thread bool runtime_initialized = false;
+
 // Caller is normal code, calls the runtime code
 // Need to save/restore the callee-saved registers and setup the runtime
-unsigned int *normalize(void (*entrypoint)(void)) {
+static struct saved_regs enter_runtime(void) {
   struct saved_regs regs = save_regs();
-  gc_init();
+  if (runtime_initialized) {
+    restore_regs(runtime_regs);
+  } else {
+    gc_init();
+    runtime_initialized = true;
+  }
+  return regs;
+}
+static void leave_runtime(struct saved_regs regs) {
+  runtime_regs = save_regs();
+  restore_regs(regs);
+}
+
+// Called after jumping to budget_exit
+static enum rt_status stopped(struct saved_regs regs) {
+  enum rt_status status = budget_stop();
+  gc_reset();
+  leave_runtime(regs);
+  return status;
+}
+
+void rt_reset(void) {
+  struct saved_regs regs = enter_runtime();
+  gc_reset();
+  leave_runtime(regs);
+}
+
+void rt_gc_stats(struct gc_stats *stats) {
+  struct saved_regs regs = enter_runtime();
+  gc_stats(stats);
+  leave_runtime(regs);
+}
+
+void rt_destroy(void) {
+  if (!runtime_initialized)
+    return;
+  gc_destroy();
+  budget_destroy();
+  free(out_buf);
+  out_buf = NULL;
+  free(var_levels);
+  var_levels = NULL;
+  var_levels_cap = 0;
+  free(quote_runs);
+  quote_runs = NULL;
+  quote_runs_cap = 0;
+  runtime_initialized = false;
+}
+
+enum rt_status normalize(void (*entrypoint)(void), unsigned int **nf) {
+  struct saved_regs regs = enter_runtime();
+  if (sigsetjmp(budget_exit, 0)) {
+    free(buf);
+    return stopped(regs);
+  }
+  budget_start();
+
   buf_len = 0;
   buf_cap = 16;
   buf = malloc(sizeof(unsigned int[buf_cap]));
+  if (!buf)
+    rt_out_of_memory();
 
   obj *main = alloc(entrypoint, 2);
-  *INFO_WORD(main) = (struct info_word) { .size = 2, .var = 0 };
+  set_info_word(main, (struct info_word) { .size = 2, .var = 0 });
   self = main;
 
-  quote();
+  quote(0);
+  if (!number_vars(buf))
+    rt_out_of_memory();
 
-  restore_regs(regs);
-  return buf;
+  budget_stop();
+  leave_runtime(regs);
+  *nf = buf;
+  return RT_OK;
+}
+
+// Check whether two closed terms have the same normal form, lazily.
+//
+// Both terms are evaluated in lockstep, one head normal form at a time, using
+// the data stack as a worklist of pairs. It stops at the first difference.
+enum rt_status convertible(void (*entrypoint1)(void), void (*entrypoint2)(void),
+    bool *equal) {
+  struct saved_regs regs = enter_runtime();
+  if (sigsetjmp(budget_exit, 0))
+    return stopped(regs);
+  budget_start();
+
+  unsigned int next_var = 0;
+  obj **data_stack_end = data_stack;
+  obj *term2 = alloc(entrypoint2, 2);
+  set_info_word(term2, (struct info_word) { .size = 2, .var = 0 });
+  *--data_stack = term2;
+  obj *term1 = alloc(entrypoint1, 2);
+  set_info_word(term1, (struct info_word) { .size = 2, .var = 0 });
+  *--data_stack = term1;
+
+  bool result = true;
+  while (data_stack != data_stack_end) {
+    // Evaluate the pair on top of the stack, in place
+    self = data_stack[0];
+    eval();
+    data_stack[0] = self;
+    self = data_stack[1];
+    eval();
+    data_stack[1] = self;
+
+    bool is_lam1 = GC_DATA(data_stack[0])->tag != RIGID;
+    bool is_lam2 = GC_DATA(data_stack[1])->tag != RIGID;
+    if (is_lam1 != is_lam2) {
+      result = false;
+      break;
+    }
+
+    if (is_lam1) {
+      // Functions f and g: compare f x and g x for a fresh x
+      obj *x = alloc(rt_rigid_entry, 2);
+      set_info_word(x, (struct info_word) { .size = 2, .var = next_var++ });
+      *--data_stack = x;
+      self = data_stack[1];
+      apply(data_stack[0]);
+      data_stack[1] = self;
+      self = data_stack[2];
+      apply(data_stack[0]);
+      data_stack[2] = self;
+      data_stack++;
+      continue;
+    }
+
+    // Rigid terms: the heads must match, then compare the args pairwise
+    obj *ne1 = data_stack[0], *ne2 = data_stack[1];
+    unsigned int argc = rigid_argc(ne1);
+    if (info_word(ne1).var != info_word(ne2).var || rigid_argc(ne2) != argc) {
+      result = false;
+      break;
+    }
+    data_stack += 2;
+    data_stack -= 2 * argc;
+    rigid_args(ne1, argc, data_stack, 2);
+    rigid_args(ne2, argc, data_stack + 1, 2);
+  }
+
+  data_stack = data_stack_end;
+  budget_stop();
+  leave_runtime(regs);
+  *equal = result;
+  return RT_OK;
 }
 
 static struct saved_regs save_regs(void) {
@@ -57,7 +227,7 @@ static struct saved_regs save_regs(void) {
     .self = self,
     .data_stack = data_stack,
     .nursery_top = nursery_top,
-    .nursery_start = nursery_start,
+    .heap_limit = heap_limit,
     .argc = argc,
   };
 }
@@ -65,23 +235,41 @@ static void restore_regs(struct saved_regs regs) {
   self = regs.self;
   data_stack = regs.data_stack;
   nursery_top = regs.nursery_top;
-  nursery_start = regs.nursery_start;
+  heap_limit = regs.heap_limit;
   argc = regs.argc;
 }
 
+static unsigned int rigid_argc(obj *r) {
+  unsigned int argc = 0;
+  for (; !RIGID_IS_VAR(r); r = RIGID_PREV(r))
+    argc += RIGID_NODE_ARGC(r);
+  return argc;
+}
+
+static void rigid_args(obj *r, unsigned int argc, obj **args, size_t stride) {
+  for (; !RIGID_IS_VAR(r); r = RIGID_PREV(r)) {
+    for (size_t i = RIGID_NODE_ARGC(r); i-- > 0;)
+      args[--argc * stride] = (obj *) RIGID_ARGS(r)[i];
+  }
+}
+
 // Apply 'self' to an argument, returning the value in 'self'
 static void apply(obj *arg) {
+  // Keep arg on the data stack while allocating, in case it GCs
+  *--data_stack = arg;
   obj *blackhole_to_update = alloc(rt_blackhole_entry, 2);
-  *INFO_WORD(blackhole_to_update) = (struct info_word) { .size = 2, .var = 0 };
-  *--data_stack = blackhole_to_update;
+  set_info_word(blackhole_to_update,
+      (struct info_word) { .size = 2, .var = 0 });
+  arg = data_stack[0];
+  data_stack[0] = blackhole_to_update;
   *--data_stack = arg;
   argc = 1;
-  self->entrypoint();
+  rt_call_on_stack(self->entrypoint, frame_stack_top);
   rt_update_thunk();
 }
 // Evaluate 'self', returning the value in 'self'
 static void eval(void) {
-  switch (GC_DATA(self)->tag) {
+  switch (GC_DATA(self)->tag & ~COMPRESSED) {
   case PAP:
   case RIGID:
   case FUN:
@@ -91,10 +279,11 @@ static void eval(void) {
     return eval();
   case THUNK:
     obj *blackhole_to_update = alloc(rt_blackhole_entry, 2);
-    *INFO_WORD(blackhole_to_update) = (struct info_word) { .size = 2, .var = 0 };
+    set_info_word(blackhole_to_update,
+        (struct info_word) { .size = 2, .var = 0 });
     *--data_stack = blackhole_to_update;
     argc = 0;
-    self->entrypoint();
+    rt_call_on_stack(self->entrypoint, frame_stack_top);
     rt_update_thunk();
     return;
   default:
@@ -102,44 +291,60 @@ static void eval(void) {
   }
 }
 
-// Write the normal form of 'self' to the buffer
-static void quote(void) {
-  // the next variable id to use for a lambda
-  unsigned int next_var = 0;
+static void push_run(size_t *runs_len, unsigned int level, unsigned int count) {
+  if (*runs_len == quote_runs_cap) {
+    size_t new_cap = 2 * quote_runs_cap + 64;
+    struct level_run *new_runs =
+      reallocarray(quote_runs, new_cap, sizeof(struct level_run));
+    if (!new_runs)
+      rt_out_of_memory();
+    quote_runs = new_runs;
+    quote_runs_cap = new_cap;
+  }
+  quote_runs[(*runs_len)++] = (struct level_run) { level, count };
+}
 
+// Write the normal form of 'self' to the buffer
+static void quote(unsigned int level) {
   eval();
 
-  // Use the data stack as a worklist
+  // Use the data stack as a worklist, with the levels of its items on the side
   obj **data_stack_end = data_stack;
+  size_t runs_len = 0;
   for (;;) {
     switch (GC_DATA(self)->tag) {
     case FUN:
     case PAP:
       {
         // Function f: λ x. quote (apply f x)
-        unsigned int var_id = next_var++;
         push_buf(LAM);
-        push_buf(var_id);
+        push_buf(level);
         obj *x = alloc(rt_rigid_entry, 2);
-        *INFO_WORD(x) = (struct info_word) { .size = 2, .var = var_id };
+        set_info_word(x, (struct info_word) { .size = 2, .var = level });
+        level++;
         apply(x);
         continue;
       }
     case RIGID:
       {
         // Rigid term head args: head (map quote args)
-        unsigned int argc = INFO_WORD(self)->size - 2;
-        unsigned int var_id = INFO_WORD(self)->var;
+        unsigned int argc = rigid_argc(self);
+        unsigned int var_id = info_word(self).var;
         push_buf(NE);
         push_buf(argc);
         push_buf(var_id);
         data_stack -= argc;
-        memcpy(data_stack, &self->contents[1], argc * sizeof(obj *));
+        rigid_args(self, argc, data_stack, 1);
+        if (argc)
+          push_run(&runs_len, level, argc);
 
         // Pop and evaluate the next item off the stack
         if (data_stack == data_stack_end)
           return;
         self = *data_stack++;
+        level = quote_runs[runs_len - 1].level;
+        if (--quote_runs[runs_len - 1].count == 0)
+          runs_len--;
         eval();
         continue;
       }
@@ -149,63 +354,434 @@ static void quote(void) {
   }
 }
 
+static bool number_vars(unsigned int *nf) {
+  // The new ids of the binders in scope, by level
+  size_t ids_cap = 64;
+  unsigned int *ids = malloc(sizeof(unsigned int[ids_cap]));
+  size_t runs_len = 0, runs_cap = 64;
+  struct level_run *runs = malloc(sizeof(struct level_run[runs_cap]));
+  bool ok = ids && runs;
+
+  unsigned int next_id = 0, level = 0;
+  while (ok) {
+    for (; *nf == LAM; nf += 2) {
+      if (level == ids_cap) {
+        unsigned int *new_ids = reallocarray(ids, 2 * ids_cap,
+            sizeof(unsigned int));
+        if (!new_ids) {
+          ok = false;
+          break;
+        }
+        ids = new_ids;
+        ids_cap *= 2;
+      }
+      ids[level++] = nf[1] = next_id++;
+    }
+    if (!ok)
+      break;
+
+    unsigned int argc = 0;
+    if (*nf == NE) {
+      argc = nf[1];
+      nf[2] = ids[nf[2]];
+      nf += 3;
+    } else {
+      nf++;
+    }
+    if (argc) {
+      if (runs_len == runs_cap) {
+        struct level_run *new_runs = reallocarray(runs, 2 * runs_cap,
+            sizeof(struct level_run));
+        if (!new_runs) {
+          ok = false;
+          break;
+        }
+        runs = new_runs;
+        runs_cap *= 2;
+      }
+      runs[runs_len++] = (struct level_run) { level, argc };
+    }
+
+    if (!runs_len)
+      break;
+    level = runs[runs_len - 1].level;
+    if (--runs[runs_len - 1].count == 0)
+      runs_len--;
+  }
+
+  free(ids);
+  free(runs);
+  return ok;
+}
+
+bool nf_number_vars(unsigned int *nf) {
+  return number_vars(nf);
+}
+
+
+/***************** Head normal forms ****************/
+
+nf_handle hnf_root(void (*entrypoint)(void)) {
+  struct saved_regs regs = enter_runtime();
+  obj *term = alloc(entrypoint, 2);
+  set_info_word(term, (struct info_word) { .size = 2, .var = 0 });
+  nf_handle h = gc_add_root(term);
+  leave_runtime(regs);
+  return h;
+}
+
+enum rt_status hnf_force(nf_handle h, unsigned int first_var, struct hnf *result) {
+  struct saved_regs regs = enter_runtime();
+  if (sigsetjmp(budget_exit, 0))
+    return stopped(regs);
+  budget_start();
+
+  self = gc_get_root(h);
+  eval();
+
+  // Go under the lambdas
+  result->lams = 0;
+  while (GC_DATA(self)->tag != RIGID) {
+    obj *x = alloc(rt_rigid_entry, 2);
+    set_info_word(x, (struct info_word) {
+      .size = 2,
+      .var = first_var + result->lams,
+    });
+    apply(x);
+    result->lams++;
+  }
+
+  // Then the rigid term
+  result->head = info_word(self).var;
+  result->argc = rigid_argc(self);
+  result->args = malloc(sizeof(nf_handle[result->argc]));
+  if (!result->args)
+    rt_out_of_memory();
+  unsigned int i = result->argc;
+  for (obj *r = self; !RIGID_IS_VAR(r); r = RIGID_PREV(r)) {
+    for (size_t j = RIGID_NODE_ARGC(r); j-- > 0;)
+      result->args[--i] = gc_add_root((obj *) RIGID_ARGS(r)[j]);
+  }
+
+  budget_stop();
+  leave_runtime(regs);
+  return RT_OK;
+}
+
+void hnf_release(nf_handle h) {
+  gc_remove_root(h);
+}
+
+struct gc_graph *hnf_export(nf_handle h) {
+  struct saved_regs regs = enter_runtime();
+  struct gc_graph *g = gc_export(gc_get_root(h));
+  leave_runtime(regs);
+  return g;
+}
+
+enum rt_status hnf_import(struct gc_graph *g, nf_handle *h) {
+  struct saved_regs regs = enter_runtime();
+  if (sigsetjmp(budget_exit, 0))
+    return stopped(regs);
+  budget_start();
+
+  gc_reset();
+  *h = gc_add_root(gc_import(g));
+
+  budget_stop();
+  leave_runtime(regs);
+  return RT_OK;
+}
+
+enum rt_status hnf_normalize(nf_handle h, unsigned int level, unsigned int **nf) {
+  struct saved_regs regs = enter_runtime();
+  if (sigsetjmp(budget_exit, 0)) {
+    free(buf);
+    return stopped(regs);
+  }
+  budget_start();
+
+  buf_len = 0;
+  buf_cap = 16;
+  buf = malloc(sizeof(unsigned int[buf_cap]));
+  if (!buf)
+    rt_out_of_memory();
+
+  self = gc_get_root(h);
+  quote(level);
+
+  budget_stop();
+  leave_runtime(regs);
+  *nf = buf;
+  return RT_OK;
+}
+
 
 /***************** Printing ****************/
 
-static unsigned int *print(unsigned int *nf, bool parens);
-static unsigned int *print_rest_of_lam(unsigned int *nf);
+// Output is buffered and written straight to the fd, bypassing stdio
+#define OUT_BUF_BYTES (1024 * 1024)
 
-void print_normal_form(unsigned int *nf) {
-  print(nf, false);
-  printf("\n");
-}
-
-static void print_var(unsigned int var) {
-  // TODO: there's probably a nicer way to print variables
-  if (var < 26)
-    printf("%c", 'a' + var);
-  else
-    printf("v%u", var);
-}
-
-static unsigned int *print(unsigned int *nf, bool parens) {
-  switch (*nf) {
-  case LAM:
-    if (parens) printf("(");
-    printf("λ");
-    nf = print_rest_of_lam(nf);
-    if (parens) printf(")");
-    return nf;
-  case NE:
-    nf++;
-    unsigned int argc = *nf++;
-    unsigned int var = *nf++;
-    if (parens && argc) printf("(");
-    print_var(var);
-    for (unsigned i = 0; i < argc; i++) {
-      printf(" ");
-      nf = print(nf, true);
+static __thread size_t out_len;
+static __thread int out_fd;
+static __thread size_t out_tokens;
+// Whether to frame each write with its length
+static __thread bool out_chunked;
+// The errno from the first failed write, or ENOMEM if printing ran out of
+// memory. After that, output is dropped
+static __thread int out_errno;
+
+static bool write_all(int fd, const char *data, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    ssize_t n = write(fd, data + written, len - written);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      out_errno = errno;
+      return false;
     }
-    if (parens && argc) printf(")");
-    return nf;
-  default:
-    failwith("unreachable");
+    written += n;
   }
+  return true;
 }
 
-static unsigned int *print_rest_of_lam(unsigned int *nf) {
-  switch (*nf) {
-  case LAM:
-    nf++;
-    printf(" ");
-    print_var(*nf++);
-    return print_rest_of_lam(nf);
-  case NE:
-    printf(". ");
-    return print(nf, false);
-  default:
-    failwith("unreachable");
+static void out_flush(void) {
+  if (out_len && !out_errno) {
+    uint32_t header = out_len;
+    if (!out_chunked || write_all(out_fd, (char *) &header, sizeof(header)))
+      write_all(out_fd, out_buf, out_len);
   }
+  out_len = 0;
+}
+
+// Make sure there's space for at least len more bytes
+static inline void out_reserve(size_t len) {
+  if (out_len + len > OUT_BUF_BYTES)
+    out_flush();
+}
+
+static inline void out_str(const char *str, size_t len) {
+  out_reserve(len);
+  memcpy(out_buf + out_len, str, len);
+  out_len += len;
+}
+#define OUT_LIT(lit) out_str(lit, sizeof(lit) - 1)
+
+static inline void out_char(char c) {
+  out_reserve(1);
+  out_buf[out_len++] = c;
+}
+
+static inline void out_uint(unsigned int x) {
+  char digits[10];
+  int i = sizeof(digits);
+  do {
+    digits[--i] = '0' + x % 10;
+    x /= 10;
+  } while (x);
+  out_str(digits + i, sizeof(digits) - i);
+}
+
+static inline void out_var(unsigned int var) {
+  out_tokens++;
+  if (var < 26) {
+    out_char('a' + var);
+  } else {
+    out_char('v');
+    out_uint(var);
+  }
+}
+
+// var_levels: levels of the binders, indexed by variable id, for de Bruijn
+// indices
+
+static void set_var_level(unsigned int var, unsigned int level) {
+  if (var >= var_levels_cap) {
+    size_t new_cap = 2 * (size_t) var + 16;
+    unsigned int *new_levels =
+      reallocarray(var_levels, new_cap, sizeof(unsigned int));
+    if (!new_levels) {
+      out_errno = ENOMEM;
+      return;
+    }
+    var_levels = new_levels;
+    var_levels_cap = new_cap;
+  }
+  var_levels[var] = level;
+}
+
+// An application whose arguments are still being printed
+struct print_frame {
+  unsigned int args_left;
+  // How many close parens to print when it's done
+  unsigned int close_parens;
+  // The level to go back to when it's done
+  unsigned int level;
+};
+
+static void print_nf(unsigned int *nf, enum nf_syntax syntax) {
+  size_t stack_len = 0, stack_cap = 64;
+  struct print_frame *stack = malloc(sizeof(struct print_frame[stack_cap]));
+  if (!stack || !out_buf) {
+    out_errno = ENOMEM;
+    free(stack);
+    return;
+  }
+
+  unsigned int level = 0;
+  bool parens = false;
+  for (;;) {
+    // Print the term at nf, parenthesized if parens
+    unsigned int close_parens = 0;
+    unsigned int start_level = level;
+    if (*nf == LAM) {
+      switch (syntax) {
+      case SYNTAX_NAMED:
+        if (parens) {
+          out_char('(');
+          out_tokens++;
+          close_parens++;
+        }
+        OUT_LIT("λ");
+        while (*nf == LAM) {
+          set_var_level(nf[1], level++);
+          out_char(' ');
+          out_var(nf[1]);
+          nf += 2;
+        }
+        OUT_LIT(". ");
+        out_tokens += 2;
+        break;
+      case SYNTAX_DE_BRUIJN:
+        if (parens) {
+          out_char('(');
+          out_tokens++;
+          close_parens++;
+        }
+        while (*nf == LAM) {
+          set_var_level(nf[1], level++);
+          OUT_LIT("λ");
+          out_tokens++;
+          nf += 2;
+        }
+        break;
+      case SYNTAX_SEXP:
+        OUT_LIT("(lambda (");
+        close_parens++;
+        while (*nf == LAM) {
+          set_var_level(nf[1], level++);
+          out_var(nf[1]);
+          nf += 2;
+          if (*nf == LAM)
+            out_char(' ');
+        }
+        OUT_LIT(") ");
+        out_tokens += 4;
+        break;
+      }
+      parens = false;
+    }
+    // Output is dropped after an error anyway, and var_levels may be missing
+    // some binders
+    if (out_errno)
+      break;
+
+    unsigned int argc = 0;
+    if (*nf == HOLE) {
+      // An unexplored term
+      OUT_LIT("…");
+      out_tokens++;
+      nf++;
+    } else if (*nf == NE) {
+      argc = nf[1];
+      unsigned int var = nf[2];
+      nf += 3;
+      if (argc && (parens || syntax == SYNTAX_SEXP)) {
+        out_char('(');
+        out_tokens++;
+        close_parens++;
+      }
+      if (syntax == SYNTAX_DE_BRUIJN) {
+        out_tokens++;
+        out_uint(level - 1 - var_levels[var]);
+      } else {
+        out_var(var);
+      }
+    } else {
+      failwith("unreachable");
+    }
+
+    if (stack_len == stack_cap) {
+      struct print_frame *new_stack = reallocarray(stack, 2 * stack_cap,
+          sizeof(struct print_frame));
+      if (!new_stack) {
+        out_errno = ENOMEM;
+        break;
+      }
+      stack = new_stack;
+      stack_cap *= 2;
+    }
+    stack[stack_len++] = (struct print_frame) {
+      .args_left = argc,
+      .close_parens = close_parens,
+      .level = start_level,
+    };
+
+    // Finish off the applications that are out of arguments
+    while (stack_len && stack[stack_len - 1].args_left == 0) {
+      struct print_frame *frame = &stack[--stack_len];
+      out_reserve(frame->close_parens);
+      for (unsigned int i = 0; i < frame->close_parens; i++)
+        out_buf[out_len++] = ')';
+      out_tokens += frame->close_parens;
+      level = frame->level;
+    }
+    if (!stack_len)
+      break;
+
+    // Then print the next argument
+    stack[stack_len - 1].args_left--;
+    out_char(' ');
+    parens = true;
+  }
+
+  out_char('\n');
+  out_flush();
+  free(stack);
+}
+
+static void start_output(int fd, bool chunked) {
+  if (!out_buf)
+    out_buf = malloc(OUT_BUF_BYTES);
+  out_fd = fd;
+  out_len = 0;
+  out_tokens = 0;
+  out_chunked = chunked;
+  out_errno = 0;
+}
+
+size_t write_normal_form(int fd, unsigned int *nf, enum nf_syntax syntax) {
+  start_output(fd, false);
+  print_nf(nf, syntax);
+  if (out_errno)
+    failwith("Couldn't write output: %s\n", strerror(out_errno));
+  return out_tokens;
+}
+
+bool stream_normal_form(int fd, unsigned int *nf, enum nf_syntax syntax) {
+  start_output(fd, true);
+  print_nf(nf, syntax);
+  // An empty chunk marks the end
+  uint32_t end = 0;
+  if (!out_errno)
+    write_all(fd, (char *) &end, sizeof(end));
+  return !out_errno;
+}
+
+void print_normal_form(unsigned int *nf) {
+  fflush(stdout);
+  write_normal_form(STDOUT_FILENO, nf, SYNTAX_NAMED);
 }
 
 
@@ -1,20 +1,207 @@
+#ifndef NORMALIZE_H
+#define NORMALIZE_H 1
+
 /** β-normalization of lambda terms
  *
  * It pre-order serializes the normal form as a malloc'd vector of unsigned
  * ints, with this layout:
- *  nf   ::= LAM var nf | NE argc var (argc nf's)
+ *  nf   ::= LAM var nf | NE argc var (argc nf's) | HOLE
  *  argc ::= an integer number of arguments
  *  var  ::= an integer variable id
  *
+ * HOLE is a part of the term that wasn't explored.
+ */
+
+enum nf_tag { LAM, NE, HOLE };
+
+/* Each thread has its own runtime, with its own heap. Limits are shared by
+ * all of them.
+ */
+
+/** Limits on each call into the runtime. 0 means unlimited */
+struct rt_limits {
+  size_t alloc_bytes;
+  size_t gcs;
+  double seconds;
+};
+
+void rt_set_limits(struct rt_limits limits);
+
+/** Cap the heap (the young generation and the old space, which is two
+ * semispaces unless it's mark-region) at about this many bytes
+ */
+void rt_set_max_heap(size_t bytes);
+
+/** Promote young objects to the old space once they've survived this many
+ * minor GCs. The default is 1, which promotes everything that survives
+ */
+void rt_set_tenure_age(int minor_gcs);
+
+/** Copy with this many threads in major GCs of big heaps. The default is 1 */
+void rt_set_gc_threads(int threads);
+
+/** Do major GCs incrementally, a slice at the end of each minor GC, aiming
+ * for pauses of at most this many seconds. 0, the default, means major GCs
+ * stop the world
+ */
+void rt_set_gc_pause_target(double seconds);
+
+/** Use a mark-region old space instead of two semispaces: major GCs mark
+ * long-lived objects where they are instead of copying them, and defragment
+ * the emptiest blocks when there's room. It has no incremental or parallel
+ * major GCs, so it ignores the two settings above
+ */
+void rt_set_mark_region(bool enabled);
+
+/** Keep the heap below 2G, so that compressed thunks can point anywhere in
+ * it. The code has to be compiled with compile_compressed too
+ */
+void rt_set_compressed(bool enabled);
+
+#define GC_PAUSE_BUCKETS 24
+
+/** Statistics about this thread's GCs, since it started */
+struct gc_stats {
+  size_t minor_gcs;
+  /** Stop-the-world major GCs */
+  size_t major_gcs;
+  size_t incremental_gcs;
+  /** Total and longest time spent in stop-the-world major GCs */
+  double major_seconds;
+  double max_major_seconds;
+  /** Total time spent in GC pauses of any kind */
+  double gc_seconds;
+  /** The most bytes left after a major GC */
+  size_t max_live_bytes;
+  /** Bytes allocated in the nursery */
+  size_t allocated_bytes;
+  /** Bytes promoted by minor GCs, and how many of those were promoted early
+   * because a survivor space was full */
+  size_t promoted_bytes;
+  size_t premature_bytes;
+  /** The number of pauses of 2^i to 2^(i+1) microseconds. The first and last
+   * buckets also count the shorter and longer ones */
+  size_t pauses[GC_PAUSE_BUCKETS];
+};
+
+void rt_gc_stats(struct gc_stats *stats);
+
+/** Running out of budget or memory throws away the whole heap, so it also
+ * invalidates all handles. The runtime is still usable afterwards.
  */
+enum rt_status { RT_OK, RT_BUDGET_EXCEEDED, RT_OUT_OF_MEMORY };
 
-enum nf_tag { LAM, NE };
+/** Throw away this thread's heap.
+ *
+ * Nothing on the heap can be used afterwards, so this has to be done before
+ * reusing the memory for the code.
+ */
+void rt_reset(void);
 
 // entrypoint is the entry code for a thunk with no environment representing the
 // lambda term
-unsigned int *normalize(void (*entrypoint)(void));
+enum rt_status normalize(void (*entrypoint)(void), unsigned int **nf);
+
+/** Check whether two closed terms are β-equivalent.
+ *
+ * It compares their normal forms lazily, evaluating both in lockstep one head
+ * normal form at a time, and stops at the first difference.
+ */
+enum rt_status convertible(void (*entrypoint1)(void), void (*entrypoint2)(void),
+    bool *equal);
+
+/** Handles to terms, for exploring a normal form one layer at a time.
+ *
+ * The GC keeps the term behind a handle alive until it's released.
+ */
+typedef size_t nf_handle;
+
+/** A term evaluated to head normal form: λ binders. head args */
+struct hnf {
+  /** The number of binders */
+  unsigned int lams;
+  unsigned int head;
+  unsigned int argc;
+  /** Handles to the (unevaluated) arguments. malloc'd; the caller frees it
+   * and releases the handles */
+  nf_handle *args;
+};
+
+/** Get a handle to a closed term */
+nf_handle hnf_root(void (*entrypoint)(void));
+
+/** Evaluate the term to head normal form.
+ *
+ * Its binders get the variable ids first_var, first_var+1, etc.
+ */
+enum rt_status hnf_force(nf_handle h, unsigned int first_var, struct hnf *result);
+
+void hnf_release(nf_handle h);
+
+struct gc_graph;
+
+/** Copy the term behind a handle, and everything it points to, for another
+ * thread to import. It's malloc'd; the caller frees it */
+struct gc_graph *hnf_export(nf_handle h);
+
+/** Throw away this thread's heap, handles included, and get a handle to a
+ * copy of an exported term. The term can be evaluated already, or part way:
+ * what's been evaluated stays that way. This overwrites the graph
+ */
+enum rt_status hnf_import(struct gc_graph *g, nf_handle *h);
+
+/** Fully normalize the term, for a term under level binders.
+ *
+ * Each binder's variable id is its level. Use nf_number_vars to number them
+ * like normalize does, once the normal form is complete
+ */
+enum rt_status hnf_normalize(nf_handle h, unsigned int level, unsigned int **nf);
+
+/** Renumber the variables from levels to the pre-order position of the
+ * binders, in place. Returns false if it runs out of memory
+ */
+bool nf_number_vars(unsigned int *nf);
+
+/** Normalize using several threads, each with its own runtime.
+ *
+ * The top of the normal form is explored first, and the arguments at the
+ * frontier are normalized in parallel. Each one gets copied into the heap of
+ * the thread that normalizes it, along with everything it points to. A
+ * worker's heap is reset for every task, so thunks that several subterms
+ * share get copied and evaluated once per task, up to TASKS_PER_THREAD times
+ * the number of threads. That duplicated work is the main cost of this.
+ */
+enum rt_status normalize_parallel(void (*entrypoint)(void), int threads,
+    unsigned int **nf);
+
+/** Free this thread's runtime */
+void rt_destroy(void);
 
+enum nf_syntax {
+  /** λ a b. a (a b) */
+  SYNTAX_NAMED,
+  /** λλ1 (1 0) */
+  SYNTAX_DE_BRUIJN,
+  /** (lambda (a b) (a (a b))) */
+  SYNTAX_SEXP,
+};
+
+/** Print a normal form to stdout, followed by a newline */
 void print_normal_form(unsigned int *nf);
 
+/** Write a normal form to fd in the given syntax, followed by a newline.
+ *
+ * Returns the number of tokens written
+ */
+size_t write_normal_form(int fd, unsigned int *nf, enum nf_syntax syntax);
+
+/** Write a normal form to fd as a series of chunks, each a 32-bit
+ * little-endian length followed by that many bytes, and then an empty chunk.
+ *
+ * Returns false if writing failed
+ */
+bool stream_normal_form(int fd, unsigned int *nf, enum nf_syntax syntax);
+
 size_t parse_church_numeral(unsigned int *nf);
 
+#endif // NORMALIZE_H
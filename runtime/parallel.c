@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "normalize.h"
+#include "builtins.h"
+
+// Split the normal form into about this many subterms per thread, so that
+// threads that finish early have more to do
+#define TASKS_PER_THREAD 8
+// Don't explore deeper than this looking for subterms
+#define MAX_SPLIT_DEPTH 32
+
+// A subterm of the normal form. The top of the normal form is explored in
+// the calling thread, breadth first, until there are enough subterms at the
+// frontier. Those get normalized in parallel
+struct node {
+  // For explored nodes
+  unsigned int lams;
+  unsigned int head;
+  unsigned int argc;
+  // The children are contiguous in the nodes vector
+  size_t first_child;
+  bool explored;
+
+  // The level of its first binder
+  unsigned int level;
+  // A handle in the calling thread's runtime, until it's explored
+  nf_handle handle;
+};
+
+struct task {
+  size_t node;
+  unsigned int level;
+  // A copy of the subterm, for a worker thread to import
+  struct gc_graph *graph;
+  unsigned int *nf;
+};
+
+struct job {
+  void *code_start, *code_end;
+  struct task *tasks;
+  size_t n_tasks;
+  _Atomic size_t next_task;
+  // The first failure, if any
+  _Atomic int status;
+  struct node *nodes;
+};
+
+static void fail(struct job *job, enum rt_status status) {
+  int ok = RT_OK;
+  atomic_compare_exchange_strong(&job->status, &ok, status);
+}
+
+// Get the next task to do, or null if there are no more
+static struct task *next_task(struct job *job) {
+  if (atomic_load(&job->status) != RT_OK)
+    return NULL;
+  size_t i = atomic_fetch_add(&job->next_task, 1);
+  return i < job->n_tasks ? &job->tasks[i] : NULL;
+}
+
+// In a runtime of its own, import the subterm and normalize it
+static enum rt_status do_task_here(struct task *task) {
+  nf_handle h;
+  enum rt_status status = hnf_import(task->graph, &h);
+  if (status != RT_OK)
+    return status;
+  status = hnf_normalize(h, task->level, &task->nf);
+  if (status == RT_OK)
+    hnf_release(h);
+  return status;
+}
+
+static void *worker(void *arg) {
+  struct job *job = arg;
+  rt_register_code(job->code_start, job->code_end);
+  struct task *task;
+  while ((task = next_task(job))) {
+    enum rt_status status = do_task_here(task);
+    if (status != RT_OK)
+      fail(job, status);
+  }
+  rt_destroy();
+  return NULL;
+}
+
+// The length of a normal form in the buffer
+static size_t nf_length(unsigned int *nf) {
+  unsigned int *start = nf;
+  size_t pending = 1;
+  while (pending) {
+    while (*nf == LAM)
+      nf += 2;
+    if (*nf == NE) {
+      pending += nf[1];
+      nf += 3;
+    } else {
+      nf++;
+    }
+    pending--;
+  }
+  return nf - start;
+}
+
+struct nf_buf {
+  unsigned int *data;
+  size_t len, cap;
+};
+
+static bool reserve(struct nf_buf *buf, size_t n) {
+  if (buf->len + n > buf->cap) {
+    size_t new_cap = 2 * (buf->len + n);
+    unsigned int *new_data =
+      reallocarray(buf->data, new_cap, sizeof(unsigned int));
+    if (!new_data)
+      return false;
+    buf->data = new_data;
+    buf->cap = new_cap;
+  }
+  return true;
+}
+
+// Write out the explored part of the normal form, filling in the tasks.
+// Returns false if it runs out of memory
+static bool assemble(struct job *job, size_t n, struct task *task_of[],
+    struct nf_buf *out) {
+  struct node *node = &job->nodes[n];
+  if (!node->explored) {
+    unsigned int *nf = task_of[n]->nf;
+    size_t len = nf_length(nf);
+    if (!reserve(out, len))
+      return false;
+    memcpy(out->data + out->len, nf, sizeof(unsigned int[len]));
+    out->len += len;
+    return true;
+  }
+  if (!reserve(out, 2 * node->lams + 3))
+    return false;
+  for (unsigned int i = 0; i < node->lams; i++) {
+    out->data[out->len++] = LAM;
+    out->data[out->len++] = node->level + i;
+  }
+  out->data[out->len++] = NE;
+  out->data[out->len++] = node->argc;
+  out->data[out->len++] = node->head;
+  for (unsigned int i = 0; i < node->argc; i++) {
+    if (!assemble(job, node->first_child + i, task_of, out))
+      return false;
+  }
+  return true;
+}
+
+enum rt_status normalize_parallel(void (*entrypoint)(void), int threads,
+    unsigned int **nf) {
+  if (threads <= 1)
+    return normalize(entrypoint, nf);
+
+  // Explore the top of the normal form, breadth first
+  size_t nodes_len = 1, nodes_cap = 64;
+  struct node *nodes = malloc(sizeof(struct node[nodes_cap]));
+  if (!nodes)
+    return RT_OUT_OF_MEMORY;
+  nodes[0] = (struct node) { .handle = hnf_root(entrypoint) };
+  size_t frontier_start = 0;
+  size_t target = TASKS_PER_THREAD * threads;
+  for (unsigned int depth = 0;
+      nodes_len - frontier_start < target && depth < MAX_SPLIT_DEPTH
+        && frontier_start < nodes_len;
+      depth++) {
+    size_t frontier_end = nodes_len;
+    for (size_t n = frontier_start; n < frontier_end; n++) {
+      struct hnf hnf;
+      enum rt_status status = hnf_force(nodes[n].handle, nodes[n].level, &hnf);
+      if (status != RT_OK) {
+        free(nodes);
+        return status;
+      }
+      hnf_release(nodes[n].handle);
+
+      if (nodes_len + hnf.argc > nodes_cap) {
+        nodes_cap = 2 * (nodes_len + hnf.argc);
+        struct node *new_nodes =
+          reallocarray(nodes, nodes_cap, sizeof(struct node));
+        if (!new_nodes) {
+          // Drop the handles that are left along with the heap
+          rt_reset();
+          free(hnf.args);
+          free(nodes);
+          return RT_OUT_OF_MEMORY;
+        }
+        nodes = new_nodes;
+      }
+      nodes[n].explored = true;
+      nodes[n].lams = hnf.lams;
+      nodes[n].head = hnf.head;
+      nodes[n].argc = hnf.argc;
+      nodes[n].first_child = nodes_len;
+      for (unsigned int i = 0; i < hnf.argc; i++) {
+        nodes[nodes_len++] = (struct node) {
+          .level = nodes[n].level + hnf.lams,
+          .handle = hnf.args[i],
+        };
+      }
+      free(hnf.args);
+    }
+    frontier_start = frontier_end;
+  }
+
+  // The frontier is what's left
+  struct job job = {
+    .n_tasks = nodes_len - frontier_start,
+    .next_task = 0,
+    .status = RT_OK,
+    .nodes = nodes,
+  };
+  rt_code_range(&job.code_start, &job.code_end);
+  job.tasks = malloc(sizeof(struct task[job.n_tasks + 1]));
+  struct task **task_of = malloc(sizeof(struct task *[nodes_len]));
+  if (!job.tasks || !task_of) {
+    rt_reset();
+    free(job.tasks);
+    free(task_of);
+    free(nodes);
+    return RT_OUT_OF_MEMORY;
+  }
+  for (size_t i = 0; i < job.n_tasks; i++) {
+    size_t n = frontier_start + i;
+    job.tasks[i] = (struct task) {
+      .node = n,
+      .level = nodes[n].level,
+      .graph = hnf_export(nodes[n].handle),
+      .nf = NULL,
+    };
+    task_of[n] = &job.tasks[i];
+  }
+
+  // Normalize them. This thread still has the handles, so it doesn't need the
+  // copies
+  int n_workers = threads - 1;
+  if ((size_t) n_workers > job.n_tasks)
+    n_workers = job.n_tasks;
+  pthread_t *workers = malloc(sizeof(pthread_t[n_workers]));
+  // Without room for them, this thread does every task itself
+  if (!workers)
+    n_workers = 0;
+  for (int i = 0; i < n_workers; i++) {
+    if (pthread_create(&workers[i], NULL, worker, &job))
+      n_workers = i;
+  }
+
+  // If this thread fails, its heap is gone along with the handles
+  bool handles_ok = true;
+  struct task *task;
+  while ((task = next_task(&job))) {
+    enum rt_status status =
+      hnf_normalize(nodes[task->node].handle, nodes[task->node].level, &task->nf);
+    if (status != RT_OK) {
+      handles_ok = false;
+      fail(&job, status);
+    }
+  }
+  for (int i = 0; i < n_workers; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  enum rt_status status = atomic_load(&job.status);
+  if (status == RT_OK) {
+    struct nf_buf out = { 0 };
+    if (assemble(&job, 0, task_of, &out) && nf_number_vars(out.data)) {
+      *nf = out.data;
+    } else {
+      free(out.data);
+      status = RT_OUT_OF_MEMORY;
+    }
+  }
+
+  for (size_t i = 0; i < job.n_tasks; i++) {
+    if (handles_ok)
+      hnf_release(nodes[job.tasks[i].node].handle);
+    free(job.tasks[i].graph);
+    free(job.tasks[i].nf);
+  }
+  free(job.tasks);
+  free(task_of);
+  free(nodes);
+  return status;
+}
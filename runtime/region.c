@@ -0,0 +1,328 @@
+#include "region.h"
+
+#define BLOCK_BYTES (32 * 1024)
+#define LINE_BYTES 128
+#define LINES (BLOCK_BYTES / LINE_BYTES)
+#define BLOCK_WORDS (BLOCK_BYTES / sizeof(word))
+#define LINE_WORDS (LINE_BYTES / sizeof(word))
+
+enum block_state { IN_USE, FREE, RELEASED };
+
+// The start of each block has its marks
+struct block {
+  // Mark bits for the objects, by their first word
+  uint8_t marks[BLOCK_WORDS / 8];
+  // The epoch each line was last marked in, or 0 if it's free
+  uint8_t lines[LINES];
+  // As of the last sweep
+  unsigned int live_lines;
+  bool evacuating;
+  enum block_state state;
+};
+#define FIRST_LINE ((sizeof(struct block) + LINE_BYTES - 1) / LINE_BYTES)
+#define USABLE_BYTES ((LINES - FIRST_LINE) * LINE_BYTES)
+
+#define BLOCK_OF(o) ((struct block *) ((size_t) (o) & ~(size_t) (BLOCK_BYTES - 1)))
+#define LINE_ADDR(b, line) ((word *) (b) + (line) * LINE_WORDS)
+
+// Every block, whatever state it's in
+static __thread struct block **blocks;
+static __thread size_t blocks_len;
+static __thread size_t blocks_cap;
+// Partly free blocks as of the last sweep, to allocate into in order
+static __thread struct block **recyclable;
+static __thread size_t recyclable_len;
+static __thread size_t next_recyclable;
+// Empty blocks, some of them given back to the OS
+static __thread struct block **free_blocks;
+static __thread size_t free_len;
+static __thread struct block **released;
+static __thread size_t released_len;
+
+// The hole it's allocating into, and the block it's in
+static __thread word *cursor;
+static __thread word *limit;
+static __thread struct block *current;
+static __thread size_t next_line;
+// Medium objects that don't fit in the current hole go in empty blocks
+// instead, so that small holes don't get skipped
+static __thread word *overflow_cursor;
+static __thread word *overflow_limit;
+
+// Bytes in blocks that aren't released, and of those, bytes that the
+// allocator hasn't reached yet
+static __thread size_t heap_bytes;
+static __thread size_t free_bytes;
+
+// What live lines get marked with: 1 or 2, alternating, so that the lines
+// marked in the last major GC can be told apart
+static __thread uint8_t epoch = 1;
+
+// Map blocks below 2G, for compressed thunks
+static __thread bool low_blocks;
+
+void region_init(bool below_2g) {
+  low_blocks = below_2g;
+  blocks_len = recyclable_len = next_recyclable = free_len = released_len = 0;
+  blocks_cap = 64;
+  blocks = malloc(sizeof(struct block *[blocks_cap]));
+  recyclable = malloc(sizeof(struct block *[blocks_cap]));
+  free_blocks = malloc(sizeof(struct block *[blocks_cap]));
+  released = malloc(sizeof(struct block *[blocks_cap]));
+  if (!blocks || !recyclable || !free_blocks || !released)
+    failwith("Couldn't allocate the heap\n");
+  cursor = limit = overflow_cursor = overflow_limit = NULL;
+  current = NULL;
+  heap_bytes = free_bytes = 0;
+}
+
+void region_destroy(void) {
+  for (size_t i = 0; i < blocks_len; i++)
+    munmap(blocks[i], BLOCK_BYTES);
+  free(blocks);
+  free(recyclable);
+  free(free_blocks);
+  free(released);
+  blocks = recyclable = free_blocks = released = NULL;
+  blocks_len = blocks_cap = 0;
+}
+
+static void reset_allocator(void) {
+  cursor = limit = overflow_cursor = overflow_limit = NULL;
+  current = NULL;
+  next_recyclable = 0;
+}
+
+void region_reset(void) {
+  recyclable_len = free_len = released_len = 0;
+  for (size_t i = 0; i < blocks_len; i++) {
+    struct block *b = blocks[i];
+    if (b->state == RELEASED) {
+      released[released_len++] = b;
+    } else {
+      memset(b, 0, sizeof(struct block));
+      b->state = FREE;
+      free_blocks[free_len++] = b;
+    }
+  }
+  free_bytes = heap_bytes;
+  reset_allocator();
+}
+
+// A new empty block, from the OS
+static struct block *new_block(void) {
+  if (released_len) {
+    struct block *b = released[--released_len];
+    // Released blocks come back zeroed
+    b->state = IN_USE;
+    heap_bytes += USABLE_BYTES;
+    free_bytes += USABLE_BYTES;
+    return b;
+  }
+
+  if (blocks_len == blocks_cap) {
+    size_t new_cap = 2 * blocks_cap;
+    struct block **new_blocks[4] = {
+      reallocarray(blocks, new_cap, sizeof(struct block *)),
+      reallocarray(recyclable, new_cap, sizeof(struct block *)),
+      reallocarray(free_blocks, new_cap, sizeof(struct block *)),
+      reallocarray(released, new_cap, sizeof(struct block *)),
+    };
+    if (new_blocks[0]) blocks = new_blocks[0];
+    if (new_blocks[1]) recyclable = new_blocks[1];
+    if (new_blocks[2]) free_blocks = new_blocks[2];
+    if (new_blocks[3]) released = new_blocks[3];
+    if (!new_blocks[0] || !new_blocks[1] || !new_blocks[2] || !new_blocks[3])
+      return NULL;
+    blocks_cap = new_cap;
+  }
+
+  // Map twice as much and trim it, to line it up
+  uint8_t *mem = mmap(NULL, 2 * BLOCK_BYTES, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | (low_blocks ? MAP_32BIT : 0), -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  uint8_t *start = (uint8_t *) (((size_t) mem + BLOCK_BYTES - 1)
+      & ~(size_t) (BLOCK_BYTES - 1));
+  if (start > mem)
+    munmap(mem, start - mem);
+  munmap(start + BLOCK_BYTES, mem + BLOCK_BYTES - start);
+
+  struct block *b = (struct block *) start;
+  b->state = IN_USE;
+  blocks[blocks_len++] = b;
+  heap_bytes += USABLE_BYTES;
+  free_bytes += USABLE_BYTES;
+  return b;
+}
+
+static struct block *take_free_block(bool grow) {
+  if (free_len) {
+    struct block *b = free_blocks[--free_len];
+    b->state = IN_USE;
+    return b;
+  }
+  return grow ? new_block() : NULL;
+}
+
+// Move on to the next hole. Returns false if there are no more
+static bool next_hole(bool grow) {
+  for (;;) {
+    if (current) {
+      while (next_line < LINES && current->lines[next_line])
+        next_line++;
+      if (next_line < LINES) {
+        size_t end = next_line;
+        while (end < LINES && !current->lines[end])
+          end++;
+        cursor = LINE_ADDR(current, next_line);
+        limit = LINE_ADDR(current, end);
+        free_bytes -= (end - next_line) * LINE_BYTES;
+        next_line = end;
+        return true;
+      }
+      current = NULL;
+    }
+    while (next_recyclable < recyclable_len
+        && recyclable[next_recyclable]->evacuating)
+      next_recyclable++;
+    if (next_recyclable < recyclable_len)
+      current = recyclable[next_recyclable++];
+    else if (!(current = take_free_block(grow)))
+      return false;
+    next_line = FIRST_LINE;
+  }
+}
+
+word *region_alloc(size_t size, bool grow) {
+  if ((size_t) (limit - cursor) >= size) {
+    word *ptr = cursor;
+    cursor += size;
+    return ptr;
+  }
+
+  if (size > LINE_WORDS) {
+    if ((size_t) (overflow_limit - overflow_cursor) < size) {
+      struct block *b = take_free_block(grow);
+      if (!b)
+        return NULL;
+      free_bytes -= USABLE_BYTES;
+      overflow_cursor = LINE_ADDR(b, FIRST_LINE);
+      overflow_limit = LINE_ADDR(b, LINES);
+    }
+    word *ptr = overflow_cursor;
+    overflow_cursor += size;
+    return ptr;
+  }
+
+  do {
+    if (!next_hole(grow))
+      return NULL;
+  } while ((size_t) (limit - cursor) < size);
+  word *ptr = cursor;
+  cursor += size;
+  return ptr;
+}
+
+size_t region_used(void) {
+  return heap_bytes - free_bytes;
+}
+
+void region_start_marking(size_t defrag_bytes) {
+  epoch = 3 - epoch;
+  for (size_t i = 0; i < blocks_len; i++) {
+    if (blocks[i]->state == IN_USE)
+      memset(blocks[i]->marks, 0, sizeof(blocks[i]->marks));
+  }
+
+  // Defragment the emptiest blocks, as many as there's room for. Go by how
+  // full they were at the last sweep
+  size_t count[LINES + 1] = { 0 };
+  for (size_t i = 0; i < blocks_len; i++) {
+    if (blocks[i]->state == IN_USE)
+      count[blocks[i]->live_lines]++;
+  }
+  size_t max_lines = 0, bytes = 0;
+  while (max_lines < (LINES - FIRST_LINE) / 2) {
+    size_t more = count[max_lines + 1] * (max_lines + 1) * LINE_BYTES;
+    if (bytes + more > defrag_bytes)
+      break;
+    bytes += more;
+    max_lines++;
+  }
+  if (!max_lines)
+    return;
+  for (size_t i = 0; i < blocks_len; i++) {
+    struct block *b = blocks[i];
+    if (b->state == IN_USE && b->live_lines > 0 && b->live_lines <= max_lines)
+      b->evacuating = true;
+  }
+  // Don't allocate into them either
+  if (current && current->evacuating) {
+    current = NULL;
+    cursor = limit = NULL;
+  }
+  if (overflow_limit && BLOCK_OF(overflow_limit - 1)->evacuating)
+    overflow_cursor = overflow_limit = NULL;
+}
+
+bool region_evacuating(obj *o) {
+  return BLOCK_OF(o)->evacuating;
+}
+
+bool region_marked(obj *o) {
+  struct block *b = BLOCK_OF(o);
+  size_t i = (word *) o - (word *) b;
+  return b->marks[i / 8] & (1 << (i % 8));
+}
+
+bool region_mark(obj *o, size_t size) {
+  struct block *b = BLOCK_OF(o);
+  size_t i = (word *) o - (word *) b;
+  if (b->marks[i / 8] & (1 << (i % 8)))
+    return false;
+  b->marks[i / 8] |= 1 << (i % 8);
+  size_t first = i / LINE_WORDS, last = (i + size - 1) / LINE_WORDS;
+  memset(&b->lines[first], epoch, last - first + 1);
+  return true;
+}
+
+size_t region_sweep(void) {
+  recyclable_len = 0;
+  size_t live = 0;
+  for (size_t i = 0; i < blocks_len; i++) {
+    struct block *b = blocks[i];
+    if (b->state != IN_USE)
+      continue;
+    unsigned int live_lines = 0;
+    for (size_t l = FIRST_LINE; l < LINES; l++) {
+      if (b->lines[l] == epoch)
+        live_lines++;
+      else
+        b->lines[l] = 0;
+    }
+    b->live_lines = live_lines;
+    b->evacuating = false;
+    live += live_lines * LINE_BYTES;
+    if (!live_lines) {
+      b->state = FREE;
+      free_blocks[free_len++] = b;
+    } else if (live_lines < LINES - FIRST_LINE) {
+      recyclable[recyclable_len++] = b;
+    }
+  }
+  free_bytes = heap_bytes - live;
+  reset_allocator();
+  return live;
+}
+
+void region_release(size_t keep_bytes) {
+  while (free_len && heap_bytes > keep_bytes) {
+    struct block *b = free_blocks[--free_len];
+    madvise(b, BLOCK_BYTES, MADV_DONTNEED);
+    b->state = RELEASED;
+    released[released_len++] = b;
+    heap_bytes -= USABLE_BYTES;
+    free_bytes -= USABLE_BYTES;
+  }
+}
@@ -0,0 +1,36 @@
+#include "runtime.h"
+
+/** The mark-region old space, Immix style.
+ *
+ * The old space is a set of 32K blocks of 128 byte lines. Objects get bump
+ * allocated into holes, runs of free lines, and never move once they're
+ * there, except when a major GC defragments a block. Major GCs mark the
+ * objects and the lines they're on, and then sweep: lines with nothing live
+ * on them are free to allocate into again.
+ */
+
+// With below_2g, every block is mapped below 2G
+void region_init(bool below_2g);
+// Throw away every object
+void region_reset(void);
+void region_destroy(void);
+
+// Allocate size words, or return null. Unless grow is set, only use blocks it
+// already has
+word *region_alloc(size_t size, bool grow);
+// Bytes in use, counting holes that got skipped
+size_t region_used(void);
+
+// Major GCs: start marking, and pick blocks to defragment with up to about
+// this many live bytes
+void region_start_marking(size_t defrag_bytes);
+// Whether the object is in a block being defragmented
+bool region_evacuating(obj *o);
+// Mark an object and its lines. Returns false if it was already marked
+bool region_mark(obj *o, size_t size);
+// Whether the object is marked already
+bool region_marked(obj *o);
+// Free the lines that weren't marked, and return how many bytes are live
+size_t region_sweep(void);
+// Give free blocks back to the OS, until the old space is at most this big
+void region_release(size_t keep_bytes);
@@ -19,17 +19,45 @@
 // The function/thunk currently being evaluated
 register obj *self asm ("rbx");
 
-// Data stack, grows downwards. I assume it never overflows
-// It contains GC roots
-#define DATA_STACK_BYTES (8*1024*1024)
+// Data stack, grows downwards. It contains GC roots
+// It's reserved up front and the kernel only backs the pages that get used.
+// Below it is a guard region, and running into that fails like running out of
+// memory. The guard region is big enough that nothing pushes right past it
+#define DATA_STACK_BYTES (1024*1024*1024UL)
+#define DATA_STACK_GUARD_BYTES (64*1024*1024)
 register obj **data_stack asm ("r12");
 
+// Generated code runs on the frame stack, a native stack reserved the same
+// way, where update frames go. So the depth of nested thunks is only limited
+// by memory
+#define FRAME_STACK_BYTES (1024*1024*1024UL)
+#define FRAME_STACK_GUARD_BYTES (1024*1024)
+extern __thread uint8_t *frame_stack_top;
+// For the SIGSEGV handler when a stack overflows
+#define SIGNAL_STACK_BYTES (64*1024)
+
+// Major GCs give back the pages of both stacks further than this below the top
+#define STACK_KEEP_BYTES (8*1024*1024)
+
 // Simple generational semispace GC
-// Allocations go downards
+// Allocations go downards, from nursery_top down to heap_limit. The heap limit
+// is usually nursery_start, but can be raised to call the GC early
 #define NURSERY_BYTES (3*1024*1024) // 3M nursery
 register word *nursery_top asm ("r13");
-register word *nursery_start asm ("r14");
-#define IS_YOUNG(o) ((size_t) (o) - (size_t) nursery_start < NURSERY_BYTES)
+register word *heap_limit asm ("r14");
+extern __thread word *nursery_start;
+// Right after the nursery are two survivor spaces, for young objects that
+// survived a minor GC but aren't old enough to promote yet
+#define SURVIVOR_BYTES (NURSERY_BYTES / 2)
+#define YOUNG_BYTES (NURSERY_BYTES + 2 * SURVIVOR_BYTES)
+#define IS_YOUNG(o) ((size_t) (o) - (size_t) nursery_start < YOUNG_BYTES)
+
+// Closed functions are static objects, allocated once by the compiler in the
+// generated code. GCs leave them where they are
+extern __thread uint8_t *rt_code_start;
+extern __thread uint8_t *rt_code_end;
+#define IS_STATIC(o) \
+  ((uint8_t *) (o) >= rt_code_start && (uint8_t *) (o) < rt_code_end)
 
 register size_t argc asm ("r15");
 
@@ -0,0 +1,234 @@
+#include "server.h"
+#include "frontend.h"
+#include "backend.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Bigger terms could run out of space for the IR or the code, which aborts
+#define MAX_REQUEST_BYTES (128 * 1024)
+#define WORKER_STACK_BYTES (64 * 1024 * 1024)
+
+static int listen_fd;
+static enum nf_syntax out_syntax;
+
+// Latencies of all the requests so far, in seconds
+static pthread_mutex_t latencies_lock = PTHREAD_MUTEX_INITIALIZER;
+static double *latencies;
+static size_t latencies_len;
+static size_t latencies_cap;
+// Requests in progress have a slot reserved, so recording never allocates
+static size_t latencies_reserved;
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Make room for one more latency. Returns false if out of memory
+static bool reserve_latency(void) {
+  bool ok = true;
+  pthread_mutex_lock(&latencies_lock);
+  if (latencies_reserved == latencies_cap) {
+    size_t new_cap = 2 * latencies_cap + 1024;
+    double *new_latencies = reallocarray(latencies, new_cap, sizeof(double));
+    if (new_latencies) {
+      latencies = new_latencies;
+      latencies_cap = new_cap;
+    } else {
+      ok = false;
+    }
+  }
+  if (ok)
+    latencies_reserved++;
+  pthread_mutex_unlock(&latencies_lock);
+  return ok;
+}
+
+static void record_latency(double latency) {
+  pthread_mutex_lock(&latencies_lock);
+  latencies[latencies_len++] = latency;
+  pthread_mutex_unlock(&latencies_lock);
+}
+
+// Returns false at EOF or on errors
+static bool read_all(int fd, void *data, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char *) data + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool write_status(int fd, uint32_t status) {
+  size_t done = 0;
+  while (done < sizeof(status)) {
+    ssize_t n = write(fd, (char *) &status + done, sizeof(status) - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+// Handle one request. Returns false if the connection should be closed
+static bool handle_request(int fd) {
+  uint32_t len;
+  if (!read_all(fd, &len, sizeof(len)))
+    return false;
+  if (len > MAX_REQUEST_BYTES) {
+    write_status(fd, SERVE_TOO_BIG);
+    return false;
+  }
+  char *source = malloc(len + 1);
+  if (!source) {
+    // The source is still unread, so the connection can't go on
+    write_status(fd, SERVE_OUT_OF_MEMORY);
+    return false;
+  }
+  if (!read_all(fd, source, len)) {
+    free(source);
+    return false;
+  }
+  source[len] = '\0';
+  if (!reserve_latency()) {
+    write_status(fd, SERVE_OUT_OF_MEMORY);
+    free(source);
+    return false;
+  }
+
+  double start = now();
+  bool ok;
+  ir term = parse(source);
+  if (!term) {
+    free_ir();
+    ok = write_status(fd, SERVE_PARSE_ERROR);
+  } else {
+    void *code = compile_toplevel(term);
+    compile_finalize();
+
+    unsigned int *nf;
+    enum rt_status status = normalize(code, &nf);
+    free_ir();
+    ok = write_status(fd, status);
+    if (status == RT_OK) {
+      ok = ok && stream_normal_form(fd, nf, out_syntax);
+      free(nf);
+    }
+
+    // Nothing refers to the code after this, so it can be reused
+    rt_reset();
+    compile_reset();
+  }
+  record_latency(now() - start);
+
+  free(source);
+  return ok;
+}
+
+static void *worker(void *arg) {
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      exit(1);
+    }
+    while (handle_request(fd))
+      ;
+    close(fd);
+  }
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static void print_latencies(double elapsed) {
+  pthread_mutex_lock(&latencies_lock);
+  size_t n = latencies_len;
+  fprintf(stderr, "%zu requests in %.1f s (%.1f requests/s)\n",
+      n, elapsed, n / elapsed);
+  if (n) {
+    qsort(latencies, n, sizeof(double), compare_doubles);
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(double); i++) {
+      size_t idx = (size_t) (percentiles[i] / 100 * (n - 1));
+      fprintf(stderr, "p%-5g %.3f ms\n", percentiles[i], latencies[idx] * 1e3);
+    }
+    fprintf(stderr, "max    %.3f ms\n", latencies[n - 1] * 1e3);
+  }
+  pthread_mutex_unlock(&latencies_lock);
+}
+
+int serve(const char *path, int workers, enum nf_syntax syntax) {
+  out_syntax = syntax;
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long\n");
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (listen_fd < 0
+      || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr))
+      || listen(listen_fd, 128)) {
+    perror(path);
+    return 1;
+  }
+
+  // Clients hanging up shouldn't kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  // Only the main thread waits for the signals to stop
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+  // The parser recurses on the native stack
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WORKER_STACK_BYTES);
+
+  double start = now();
+  for (int i = 0; i < workers; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, worker, NULL);
+    if (err) {
+      fprintf(stderr, "Couldn't start a worker: %s\n", strerror(err));
+      return 1;
+    }
+  }
+  fprintf(stderr, "Serving on %s with %d workers\n", path, workers);
+
+  int sig;
+  sigwait(&stop, &sig);
+  print_latencies(now() - start);
+  unlink(path);
+  return 0;
+}
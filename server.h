@@ -0,0 +1,30 @@
+#ifndef SERVER_H
+#define SERVER_H 1
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "runtime/normalize.h"
+
+/** Serve normalization requests on a Unix socket, with a pool of workers.
+ *
+ * Each worker thread has its own runtime and code buffer. A connection can
+ * send any number of requests, one after another. All numbers are 32-bit
+ * little-endian:
+ *  request  ::= length (length bytes of source text)
+ *  response ::= status [chunks, if the status is SERVE_OK]
+ * where the chunks are as written by stream_normal_form.
+ *
+ * It runs until SIGINT or SIGTERM, and then prints latency percentiles to
+ * stderr.
+ */
+int serve(const char *path, int workers, enum nf_syntax syntax);
+
+enum serve_status {
+  SERVE_OK = RT_OK,
+  SERVE_BUDGET_EXCEEDED = RT_BUDGET_EXCEEDED,
+  SERVE_OUT_OF_MEMORY = RT_OUT_OF_MEMORY,
+  SERVE_PARSE_ERROR,
+  SERVE_TOO_BIG,
+};
+
+#endif // SERVER_H
@@ -0,0 +1,151 @@
+#include "timings.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum counter { CYCLES, INSTRUCTIONS, BRANCH_MISSES, CACHE_MISSES, N_COUNTERS };
+
+static const uint64_t counter_config[N_COUNTERS] = {
+  [CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+  [INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+  [BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+  [CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+};
+static const char *counter_names[N_COUNTERS] = {
+  [CYCLES] = "cycles",
+  [INSTRUCTIONS] = "instructions",
+  [BRANCH_MISSES] = "branch_misses",
+  [CACHE_MISSES] = "cache_misses",
+};
+static const char *phase_names[N_PHASES] = {
+  [PHASE_PARSE] = "parse",
+  [PHASE_COMPILE] = "compile",
+  [PHASE_FINALIZE] = "finalize",
+  [PHASE_NORMALIZE] = "normalize",
+  [PHASE_PRINT] = "print",
+};
+
+// -1 for counters that aren't available
+static int counter_fds[N_COUNTERS];
+
+struct sample {
+  double wall, cpu;
+  uint64_t counters[N_COUNTERS];
+};
+
+static bool enabled = false;
+static struct sample started[N_PHASES];
+static struct sample totals[N_PHASES];
+static bool ran[N_PHASES];
+
+void timings_init(void) {
+  enabled = true;
+  for (int i = 0; i < N_COUNTERS; i++) {
+    struct perf_event_attr attr = {
+      .type = PERF_TYPE_HARDWARE,
+      .size = sizeof(attr),
+      .config = counter_config[i],
+      .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+        | PERF_FORMAT_TOTAL_TIME_RUNNING,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+      // Count the threads that normalize in parallel too
+      .inherit = 1,
+    };
+    counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+static double clock_seconds(clockid_t clock) {
+  struct timespec t;
+  clock_gettime(clock, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void sample(struct sample *s) {
+  s->wall = clock_seconds(CLOCK_MONOTONIC);
+  s->cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+  for (int i = 0; i < N_COUNTERS; i++) {
+    // The value, and the times enabled and running, to scale it by if the
+    // kernel had to multiplex the counters
+    uint64_t buf[3];
+    if (counter_fds[i] < 0 || read(counter_fds[i], buf, sizeof(buf)) != sizeof(buf)) {
+      s->counters[i] = 0;
+      continue;
+    }
+    s->counters[i] = buf[2] ? (uint64_t) ((double) buf[0] * buf[1] / buf[2]) : 0;
+  }
+}
+
+void timings_start(enum phase phase) {
+  if (!enabled)
+    return;
+  sample(&started[phase]);
+}
+
+void timings_stop(enum phase phase) {
+  if (!enabled)
+    return;
+  struct sample now;
+  sample(&now);
+  totals[phase].wall += now.wall - started[phase].wall;
+  totals[phase].cpu += now.cpu - started[phase].cpu;
+  for (int i = 0; i < N_COUNTERS; i++)
+    totals[phase].counters[i] += now.counters[i] - started[phase].counters[i];
+  ran[phase] = true;
+}
+
+static void print_table(FILE *out, double gc_seconds) {
+  fprintf(out, "%-10s %10s %10s", "phase", "wall ms", "cpu ms");
+  for (int i = 0; i < N_COUNTERS; i++) {
+    if (counter_fds[i] >= 0)
+      fprintf(out, " %14s", counter_names[i]);
+  }
+  fprintf(out, "\n");
+  for (int p = 0; p < N_PHASES; p++) {
+    if (!ran[p])
+      continue;
+    fprintf(out, "%-10s %10.3f %10.3f", phase_names[p], totals[p].wall * 1e3,
+        totals[p].cpu * 1e3);
+    for (int i = 0; i < N_COUNTERS; i++) {
+      if (counter_fds[i] >= 0)
+        fprintf(out, " %14llu", (unsigned long long) totals[p].counters[i]);
+    }
+    fprintf(out, "\n");
+  }
+  if (ran[PHASE_NORMALIZE])
+    fprintf(out, "%-10s %10.3f\n", "  gc", gc_seconds * 1e3);
+  if (counter_fds[CYCLES] < 0)
+    fprintf(out, "(no hardware counters)\n");
+}
+
+static void print_json(FILE *out, double gc_seconds) {
+  fprintf(out, "{");
+  for (int p = 0; p < N_PHASES; p++) {
+    if (!ran[p])
+      continue;
+    fprintf(out, "\"%s\": {\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f",
+        phase_names[p], totals[p].wall, totals[p].cpu);
+    for (int i = 0; i < N_COUNTERS; i++) {
+      if (counter_fds[i] >= 0)
+        fprintf(out, ", \"%s\": %llu", counter_names[i],
+            (unsigned long long) totals[p].counters[i]);
+      else
+        fprintf(out, ", \"%s\": null", counter_names[i]);
+    }
+    fprintf(out, "}, ");
+  }
+  fprintf(out, "\"gc_seconds\": %.6f}\n", gc_seconds);
+}
+
+void timings_print(FILE *out, bool json, double gc_seconds) {
+  if (json)
+    print_json(out, gc_seconds);
+  else
+    print_table(out, gc_seconds);
+}
@@ -0,0 +1,31 @@
+#ifndef TIMINGS_H
+#define TIMINGS_H 1
+
+#include <stdio.h>
+#include <stdbool.h>
+
+enum phase {
+  PHASE_PARSE,
+  PHASE_COMPILE,
+  PHASE_FINALIZE,
+  PHASE_NORMALIZE,
+  PHASE_PRINT,
+  N_PHASES
+};
+
+/** Wall and CPU time for each phase, and where perf_event_open works, CPU
+ * cycles, instructions, branch misses and cache misses.
+ *
+ * The counters count this process's user space code, in every thread.
+ */
+void timings_init(void);
+// These do nothing until timings_init gets called
+void timings_start(enum phase phase);
+void timings_stop(enum phase phase);
+
+/** Print them, as a table or as one line of JSON. The calling thread's GC
+ * time counts as part of normalizing, and gets reported on its own too.
+ */
+void timings_print(FILE *out, bool json, double gc_seconds);
+
+#endif // TIMINGS_H